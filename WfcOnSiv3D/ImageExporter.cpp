@@ -0,0 +1,88 @@
+﻿# include "stdafx.h"
+# include "ImageExporter.hpp"
+
+ImageExporter::ImageExporter(Renderer renderer, int32 encoderThreads, int32 capacity)
+	: m_renderer(std::move(renderer)), m_jobs(Max(capacity, 1)), m_encoded(Max(capacity, 1)) {
+	if (encoderThreads <= 0) {
+		encoderThreads = Max(static_cast<int32>(Threading::GetConcurrency()), 1);
+	}
+
+	for (int32 k = 0; k < encoderThreads; ++k) {
+		m_encoders.emplace_back([this] { encoderLoop(); });
+	}
+	m_writer = std::thread([this] { writerLoop(); });
+}
+
+ImageExporter::~ImageExporter() {
+	finish();
+}
+
+bool ImageExporter::push(Array<int32> observed, FilePath path) {
+	if (not IsComplete(observed)) {
+		return false;
+	}
+	return m_jobs.push(Job{ std::move(observed), std::move(path) });
+}
+
+bool ImageExporter::tryPush(Array<int32>& observed, FilePath& path) {
+	if (not IsComplete(observed)) {
+		return false;
+	}
+
+	Job job{ std::move(observed), std::move(path) };
+
+	if (m_jobs.tryPush(job)) {
+		return true;
+	}
+
+	observed = std::move(job.observed);
+	path = std::move(job.path);
+	return false;
+}
+
+void ImageExporter::finish() {
+	// デストラクタと他のスレッドからの finish() が重なっても、閉じて join するのは最初の1回だけ
+	// 後から来た側は、最初の呼び出しが書き終えるまでここで待つ
+	std::lock_guard lock{ m_finishMutex };
+	if (m_finished) {
+		return;
+	}
+	m_finished = true;
+
+	// 符号化が全部終わってから書き込み側を閉じる
+	m_jobs.close();
+	for (auto& encoder : m_encoders) {
+		encoder.join();
+	}
+
+	m_encoded.close();
+	m_writer.join();
+}
+
+bool ImageExporter::IsComplete(const Array<int32>& observed) {
+	// 描画側は範囲を確かめずにタイルを引くので、ここで弾く
+	if (std::any_of(observed.begin(), observed.end(), [](int32 t) { return t < 0; })) {
+		std::cout << "ERROR: the grid has unobserved cells" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void ImageExporter::encoderLoop() {
+	while (auto job = m_jobs.pop()) {
+		const Image image = m_renderer(job->observed);
+		m_encoded.push(Encoded{ image.encodePNG(), std::move(job->path) });
+	}
+}
+
+void ImageExporter::writerLoop() {
+	while (auto encoded = m_encoded.pop()) {
+		if (not encoded->png.isEmpty() && encoded->png.save(encoded->path)) {
+			++m_written;
+		}
+		else {
+			std::cout << "ERROR: failed to write " << encoded->path << std::endl;
+			++m_failed;
+		}
+	}
+}
@@ -0,0 +1,79 @@
+﻿# pragma once
+# include "ParallelHelper.hpp"
+
+// 完了した盤面を大量に書き出すための段。描画とPNG圧縮は符号化スレッド群が、ファイル書き込みは書き込みスレッドが行う
+// 解くスレッドは observed() の写しを push() するだけで、圧縮もディスクも待たない
+// 待ち行列が満杯のときだけ push() が空くまで待つので、書き出しが追いつかなくてもメモリは capacity 件分で頭打ちになる
+//
+//	ImageExporter exporter{ [rules, size](const Array<int32>& observed) {
+//		return OverlappingModel::RenderObserved(*rules, observed, size);
+//	}, 4, 64 };
+//	exporter.push(model.observed(), U"out/{}.png"_fmt(seed));
+class ImageExporter
+{
+public:
+
+	using Renderer = std::function<Image(const Array<int32>& observed)>;
+
+	// encoderThreads <= 0 ならハードウェアスレッド数
+	ImageExporter(Renderer renderer, int32 encoderThreads, int32 capacity);
+
+	// 積まれた分をすべて書き終えるまで待つ
+	~ImageExporter();
+
+	ImageExporter(const ImageExporter&) = delete;
+	ImageExporter& operator=(const ImageExporter&) = delete;
+
+	// 待ち行列が満杯なら空くまで待つ。finish() 後と、未確定(-1)のセルを含む盤面は積まずに false
+	// observed は isObservationStored() になったモデルから取る
+	bool push(Array<int32> observed, FilePath path);
+
+	// 満杯なら待たずに false。そのとき引数は動かさない
+	bool tryPush(Array<int32>& observed, FilePath& path);
+
+	// 以降の push() を断り、積まれた分を書き終えるまで待つ。どのスレッドから何度呼んでもよい
+	void finish();
+
+	// 書き出しに成功した枚数
+	int32 writtenCount() const {
+		return m_written;
+	}
+
+	// 書き込みに失敗した枚数
+	int32 failedCount() const {
+		return m_failed;
+	}
+
+private:
+
+	struct Job {
+		Array<int32> observed;
+		FilePath path;
+	};
+
+	struct Encoded {
+		Blob png;
+		FilePath path;
+	};
+
+	static bool IsComplete(const Array<int32>& observed);
+
+	void encoderLoop();
+
+	void writerLoop();
+
+	Renderer m_renderer;
+
+	BoundedQueue<Job> m_jobs;
+
+	// 書き込みが遅いときは符号化スレッドもここで止まり、m_jobs が埋まって push() に背圧がかかる
+	BoundedQueue<Encoded> m_encoded;
+
+	Array<std::thread> m_encoders;
+	std::thread m_writer;
+
+	std::atomic<int32> m_written{ 0 };
+	std::atomic<int32> m_failed{ 0 };
+	std::mutex m_finishMutex;
+	bool m_finished = false;
+};
@@ -1,27 +1,38 @@
 ﻿# include "stdafx.h"
 # include "OverlappingModel.hpp"
 
-OverlappingModel::OverlappingModel(const String& name, int32 N, const Size& m_gridSize, bool periodicInput, bool periodic, int32 symmetry, bool ground, Heuristic heuristic)
-	: WfcModel(m_gridSize, N, periodic, heuristic) {
+OverlappingModel::OverlappingModel(const String& name, int32 N, const Size& gridSize, bool periodicInput, bool periodic, int32 symmetry, bool ground, Heuristic heuristic)
+	: OverlappingModel(OverlappingRuleSet::Load(name, N, periodicInput, symmetry), gridSize, periodic, ground, heuristic) {}
+
+OverlappingModel::OverlappingModel(std::shared_ptr<const OverlappingRuleSet> rules, const Size& gridSize, bool periodic, bool ground, Heuristic heuristic)
+	: WfcModel(rules, gridSize, rules->N, periodic, heuristic), m_ruleSet(std::move(rules)) {
+	m_ground = ground;
+}
+
+std::shared_ptr<const OverlappingRuleSet> OverlappingRuleSet::Load(const String& name, int32 N, bool periodicInput, int32 symmetry) {
+	auto rules = std::make_shared<OverlappingRuleSet>();
+	rules->N = N;
+
+	Array<Color>& colors = rules->colors;
+	Array<Grid<uint8>>& patterns = rules->patterns;
+
 	auto bitmap = BitmapHelper::LoadBitmap(name);
 
 	Grid<uint8> sample(bitmap.size());
 
-	m_colors.clear();
-
 	for (auto y : step(sample.height())) {
 		for (auto x : step(sample.width())) {
 
 			const Color& color = bitmap[y][x];
 			int32 k = 0;
 
-			for (; k < m_colors.size(); k++) {
-				if (m_colors[k] == color) {
+			for (; k < colors.size(); k++) {
+				if (colors[k] == color) {
 					break;
 				}
 			}
-			if (k == m_colors.size()) {
-				m_colors << color;
+			if (k == colors.size()) {
+				colors << color;
 			}
 			sample[y][x] = static_cast<uint8>(k);
 		}
@@ -50,51 +61,87 @@ OverlappingModel::OverlappingModel(const String& name, int32 N, const Size& m_gr
 		return result;
 		};
 
-	m_patterns.clear();
-	HashTable<int64, int32> patternIndices;
-	Array<double> weightList;
+	// 行をいくつかの帯に分けて帯ごとに数え、帯の順に合わせる。
+	// 帯の中での初出順を保ったまま合わせるので、パターンの順序と重みは全体を1度に走査した場合と同じになる
+	struct Shard {
+		HashTable<int64, int32> indices;
+		Array<int64> hashes;
+		Array<Grid<uint8>> patterns;
+		Array<double> weights;
+	};
 
-	const int32 C = m_colors.size();
+	constexpr int32 MinShardRows = 16;
+
+	const int32 C = colors.size();
 	const int32 xmax = periodicInput ? bitmap.width() : bitmap.width() - N + 1;
 	const int32 ymax = periodicInput ? bitmap.height() : bitmap.height() - N + 1;
-	for (auto y = 0; y < ymax; y++) {
-		for (auto x = 0; x < xmax; x++) {
-			Array<Grid<uint8>> ps(8, Grid<uint8>(N, N));
-
-			ps[0] = pattern([&](int32 dx, int32 dy) -> uint8 {return sample[(y + dy) % bitmap.height()][(x + dx) % bitmap.width()]; }, N);
-			ps[1] = GridHelper::mirrored(ps[0]);
-			ps[2] = GridHelper::rotated270(ps[0]);
-			ps[3] = GridHelper::mirrored(ps[2]);
-			ps[4] = GridHelper::rotated270(ps[2]);
-			ps[5] = GridHelper::mirrored(ps[4]);
-			ps[6] = GridHelper::rotated270(ps[4]);
-			ps[7] = GridHelper::mirrored(ps[6]);
-
-			for (int32 k = 0; k < symmetry; k++) {
-				const auto& p = ps[k];
-				const auto h = hash(p, C);
-
-				// patternIndicesのキーとしてhが存在するか確認
-				auto it = patternIndices.find(h);
-				if (it != patternIndices.end()) {
-
-					// キーが存在する場合
-					weightList[it->second] += 1.0;
-				}
-				else {
 
-					// キーが存在しない場合
-					patternIndices[h] = weightList.size();
-					weightList << 1.0;
-					m_patterns << p;
+	const int32 shardCount = Clamp(ymax / MinShardRows, 1, static_cast<int32>(Threading::GetConcurrency()) * 4);
+	Array<Shard> shards(shardCount);
+
+	ParallelHelper::For(shardCount, [&](int32 s) {
+		Shard& shard = shards[s];
+		const int32 y0 = static_cast<int32>(static_cast<int64>(ymax) * s / shardCount);
+		const int32 y1 = static_cast<int32>(static_cast<int64>(ymax) * (s + 1) / shardCount);
+
+		Array<Grid<uint8>> ps(8, Grid<uint8>(N, N));
+
+		for (auto y = y0; y < y1; y++) {
+			for (auto x = 0; x < xmax; x++) {
+				ps[0] = pattern([&](int32 dx, int32 dy) -> uint8 {return sample[(y + dy) % bitmap.height()][(x + dx) % bitmap.width()]; }, N);
+				ps[1] = GridHelper::mirrored(ps[0]);
+				ps[2] = GridHelper::rotated270(ps[0]);
+				ps[3] = GridHelper::mirrored(ps[2]);
+				ps[4] = GridHelper::rotated270(ps[2]);
+				ps[5] = GridHelper::mirrored(ps[4]);
+				ps[6] = GridHelper::rotated270(ps[4]);
+				ps[7] = GridHelper::mirrored(ps[6]);
+
+				for (int32 k = 0; k < symmetry; k++) {
+					const auto& p = ps[k];
+					const auto h = hash(p, C);
+
+					auto it = shard.indices.find(h);
+					if (it != shard.indices.end()) {
+						shard.weights[it->second] += 1.0;
+					}
+					else {
+						shard.indices[h] = shard.weights.size();
+						shard.hashes << h;
+						shard.weights << 1.0;
+						shard.patterns << p;
+					}
 				}
 			}
 		}
+	});
+
+	HashTable<int64, int32> patternIndices;
+	Array<double> weightList;
+
+	for (auto& shard : shards) {
+		for (size_t j = 0; j < shard.hashes.size(); j++) {
+			const int64 h = shard.hashes[j];
+
+			// patternIndicesのキーとしてhが存在するか確認
+			auto it = patternIndices.find(h);
+			if (it != patternIndices.end()) {
+
+				// キーが存在する場合
+				weightList[it->second] += shard.weights[j];
+			}
+			else {
+
+				// キーが存在しない場合
+				patternIndices[h] = weightList.size();
+				weightList << shard.weights[j];
+				patterns << std::move(shard.patterns[j]);
+			}
+		}
 	}
 
-	m_weights = weightList;
-	m_T = m_weights.size();
-	this->m_ground = ground;
+	rules->weights = weightList;
+	const int32 T = rules->weights.size();
 
 	static auto agrees = [](const Grid<uint8>& p1, const Grid<uint8>& p2, const Point& dxy, int32 N) {
 		const int32 xmin = dxy.x < 0 ? 0 : dxy.x, xmax = dxy.x < 0 ? dxy.x + N : N;
@@ -109,76 +156,92 @@ OverlappingModel::OverlappingModel(const String& name, int32 N, const Size& m_gr
 		return true;
 		};
 
-	m_propagator.resize(4);
+	auto& propagator = rules->propagator;
+	propagator.resize(4);
 	for (int32 d = 0; d < 4; d++) {
-		m_propagator[d].resize(m_T);
-		for (int32 t = 0; t < m_T; t++) {
+		propagator[d].resize(T);
+		for (int32 t = 0; t < T; t++) {
 			Array<int32> list;
-			for (int32 t2 = 0; t2 < m_T; t2++)
-				if (agrees(m_patterns[t], m_patterns[t2], dxy[d], N))
+			for (int32 t2 = 0; t2 < T; t2++)
+				if (agrees(patterns[t], patterns[t2], Topology2D::Offsets[d], N))
 					list.push_back(t2);
-			m_propagator[d][t] = list;
+			propagator[d][t] = list;
 		}
 	}
+
+	rules->finalize();
+	return rules;
 }
 
 Image OverlappingModel::toImage() const
 {
-	Grid<Color> bitmap(m_gridSize);
-
-	if (m_observed[0][0] >= 0) {
-		for (int32 y = 0; y < m_gridSize.y; y++) {
-			int32 dy = y < m_gridSize.y - m_N + 1 ? 0 : m_N - 1;
+	const auto& patterns = m_ruleSet->patterns;
+	const auto& colors = m_ruleSet->colors;
 
-			for (int32 x = 0; x < m_gridSize.x; x++) {
-				int32 dx = x < m_gridSize.x - m_N + 1 ? 0 : m_N - 1;
-				bitmap[y][x] = m_colors[m_patterns[m_observed[y - dy][x - dx]][dy][dx]];
-			}
-		}
+	if (isObservationStored()) {
+		return RenderObserved(*m_ruleSet, m_observed, m_gridSize);
 	}
-	else {
-		for (auto y : step(m_wave.height())) {
-			for (auto x : step(m_wave.width())) {
 
-				int32 contributors = 0;
+	Grid<Color> bitmap(m_gridSize);
 
-				int32 r{ 0 };
-				int32 g{ 0 };
-				int32 b{ 0 };
+	for (auto y : step(m_gridSize.y)) {
+		for (auto x : step(m_gridSize.x)) {
 
-				for (int32 dy = 0; dy < m_N; dy++) {
-					for (int32 dx = 0; dx < m_N; dx++) {
-						auto sxy = Point{ x, y } - Point{ dx ,dy };
+			int32 contributors = 0;
 
-						if (sxy.x < 0)
-							sxy.x += m_gridSize.x;
+			int32 r{ 0 };
+			int32 g{ 0 };
+			int32 b{ 0 };
 
-						if (sxy.y < 0)
-							sxy.y += m_gridSize.y;
+			for (int32 dy = 0; dy < m_N; dy++) {
+				for (int32 dx = 0; dx < m_N; dx++) {
+					auto sxy = Point{ x, y } - Point{ dx ,dy };
 
-						if (!m_periodic && (sxy.x + m_N > m_gridSize.x || sxy.y + m_N > m_gridSize.y || sxy.x < 0 || sxy.y < 0)) {
-							continue;
-						}
+					if (sxy.x < 0)
+						sxy.x += m_gridSize.x;
+
+					if (sxy.y < 0)
+						sxy.y += m_gridSize.y;
 
-						for (int32 t = 0; t < m_T; ++t) {
-							if (m_wave[sxy][t]) {
-								contributors++;
-								const auto& argb = m_colors[m_patterns[t][dy][dx]];
-								r += argb.r;
-								g += argb.g;
-								b += argb.b;
-							}
+					if (!m_periodic && (sxy.x + m_N > m_gridSize.x || sxy.y + m_N > m_gridSize.y || sxy.x < 0 || sxy.y < 0)) {
+						continue;
+					}
+
+					for (int32 t = 0; t < m_T; ++t) {
+						if (isPossible(cellIndex(sxy), t)) {
+							contributors++;
+							const auto& argb = colors[patterns[t][dy][dx]];
+							r += argb.r;
+							g += argb.g;
+							b += argb.b;
 						}
 					}
 				}
-				bitmap[y][x] = Color(
-					static_cast<uint8>(r / contributors),
-					static_cast<uint8>(g / contributors),
-					static_cast<uint8>(b / contributors)
-				);
 			}
+			bitmap[y][x] = Color(
+				static_cast<uint8>(r / contributors),
+				static_cast<uint8>(g / contributors),
+				static_cast<uint8>(b / contributors)
+			);
 		}
 	}
 
 	return BitmapHelper::ToImage(bitmap);
 }
+
+Image OverlappingModel::RenderObserved(const OverlappingRuleSet& rules, const Array<int32>& observed, const Size& gridSize)
+{
+	const int32 N = rules.N;
+	Image image{ gridSize };
+
+	for (int32 y = 0; y < gridSize.y; y++) {
+		int32 dy = y < gridSize.y - N + 1 ? 0 : N - 1;
+
+		for (int32 x = 0; x < gridSize.x; x++) {
+			int32 dx = x < gridSize.x - N + 1 ? 0 : N - 1;
+			image[y][x] = rules.colors[rules.patterns[observed[Topology2D::Index(gridSize, { x - dx, y - dy })]][dy][dx]];
+		}
+	}
+
+	return image;
+}
@@ -3,21 +3,40 @@
 # include "BitmapHelper.hpp"
 # include "GridHelper.h"
 
+// 入力画像から切り出したN×Nパターンの規則。読み込み後は複数のOverlappingModelで共有できる
+struct OverlappingRuleSet : WfcRuleSet {
+
+	int32 N = 0;
+
+	Array<Grid<uint8>> patterns;
+
+	Array<Color> colors;
+
+	static std::shared_ptr<const OverlappingRuleSet> Load(const String& name, int32 N, bool periodicInput, int32 symmetry);
+};
+
 class OverlappingModel : public WfcModel {
 
 public:
 	OverlappingModel(const String& name, int32 N, const Size& gridSize, bool periodicInput, bool periodic, int32 symmetry, bool ground, Heuristic heuristic);
 
+	OverlappingModel(std::shared_ptr<const OverlappingRuleSet> rules, const Size& gridSize, bool periodic, bool ground, Heuristic heuristic);
+
 	Image toImage() const;
 
+	// 完了した observed() の内容を描く。モデルを持たずに描けるので、書き出しスレッドから呼べる
+	static Image RenderObserved(const OverlappingRuleSet& rules, const Array<int32>& observed, const Size& gridSize);
+
 	inline const Size& imageSize() const
 	{
 		return m_gridSize;
 	}
 
-private:
-	Array<Grid<uint8>> m_patterns;
+	inline const std::shared_ptr<const OverlappingRuleSet>& ruleSet() const
+	{
+		return m_ruleSet;
+	}
 
-	Array<Color> m_colors;
+private:
+	std::shared_ptr<const OverlappingRuleSet> m_ruleSet;
 };
-
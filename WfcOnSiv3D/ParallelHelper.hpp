@@ -0,0 +1,230 @@
+﻿# pragma once
+# include <atomic>
+# include <condition_variable>
+# include <deque>
+# include <functional>
+# include <mutex>
+# include <optional>
+# include <thread>
+
+class ParallelHelper
+{
+public:
+
+	// f(i) を [0, count) の各iについて呼ぶ。処理時間がばらつく仕事向けに、番号を1つずつ取り合う
+	template <class Fn>
+	static void For(int32 count, Fn f) {
+		const int32 threads = ThreadCount(count, 1);
+		if (threads <= 1) {
+			for (int32 i = 0; i < count; ++i) {
+				f(i);
+			}
+			return;
+		}
+
+		std::atomic<int32> next{ 0 };
+		Run(threads, [&](int32) {
+			for (int32 i = next++; i < count; i = next++) {
+				f(i);
+			}
+		});
+	}
+
+	// [0, count) をスレッド数で等分し、f(begin, end) を呼ぶ。1区間が minChunk 未満にならないようにする
+	template <class Fn>
+	static void ForRange(int32 count, int32 minChunk, Fn f) {
+		const int32 threads = ThreadCount(count, minChunk);
+		if (threads <= 1) {
+			if (count > 0) {
+				f(0, count);
+			}
+			return;
+		}
+
+		Run(threads, [&](int32 k) {
+			f(static_cast<int32>(static_cast<int64>(count) * k / threads), static_cast<int32>(static_cast<int64>(count) * (k + 1) / threads));
+		});
+	}
+
+private:
+
+	static int32 ThreadCount(int32 count, int32 minChunk) {
+		return Clamp(count / Max(minChunk, 1), 1, static_cast<int32>(Threading::GetConcurrency()));
+	}
+
+	template <class Fn>
+	static void Run(int32 threads, Fn worker) {
+		Array<std::thread> pool;
+		pool.reserve(threads - 1);
+
+		for (int32 k = 1; k < threads; ++k) {
+			pool.emplace_back(worker, k);
+		}
+		worker(0);
+
+		for (auto& thread : pool) {
+			thread.join();
+		}
+	}
+};
+
+// 常駐させたスレッドで同じ仕事を一斉に走らせる。短い仕事を何度も投げるときにスレッド生成の手間を省く
+class WorkerTeam
+{
+public:
+
+	explicit WorkerTeam(int32 threads) {
+		for (int32 k = 1; k < threads; ++k) {
+			m_threads.emplace_back([this, k] { workerLoop(k); });
+		}
+	}
+
+	~WorkerTeam() {
+		{
+			std::lock_guard lock{ m_mutex };
+			m_stop = true;
+		}
+		m_wake.notify_all();
+
+		for (auto& thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	WorkerTeam(const WorkerTeam&) = delete;
+	WorkerTeam& operator=(const WorkerTeam&) = delete;
+
+	int32 size() const {
+		return static_cast<int32>(m_threads.size()) + 1;
+	}
+
+	// job(k) を k = 0 .. size()-1 で同時に呼び、全員が戻るまで待つ。k = 0 は呼び出し元のスレッド
+	void run(const std::function<void(int32)>& job) {
+		{
+			std::lock_guard lock{ m_mutex };
+			m_job = &job;
+			m_running = static_cast<int32>(m_threads.size());
+			++m_generation;
+		}
+		m_wake.notify_all();
+
+		job(0);
+
+		std::unique_lock lock{ m_mutex };
+		m_done.wait(lock, [this] { return m_running == 0; });
+		m_job = nullptr;
+	}
+
+private:
+
+	void workerLoop(int32 k) {
+		uint64 seen = 0;
+
+		for (;;) {
+			const std::function<void(int32)>* job = nullptr;
+			{
+				std::unique_lock lock{ m_mutex };
+				m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+
+				if (m_stop) {
+					return;
+				}
+				seen = m_generation;
+				job = m_job;
+			}
+
+			(*job)(k);
+
+			{
+				std::lock_guard lock{ m_mutex };
+				--m_running;
+			}
+			m_done.notify_one();
+		}
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+
+	const std::function<void(int32)>* m_job = nullptr;
+	uint64 m_generation = 0;
+	int32 m_running = 0;
+	bool m_stop = false;
+
+	Array<std::thread> m_threads;
+};
+
+// 上限つきの待ち行列。満杯なら push() は空くまで、空なら pop() は届くまで待つ
+template <class Type>
+class BoundedQueue
+{
+public:
+
+	explicit BoundedQueue(size_t capacity)
+		: m_capacity(Max<size_t>(capacity, 1)) {}
+
+	// close() 後は積まずに false
+	bool push(Type value) {
+		std::unique_lock lock{ m_mutex };
+		m_notFull.wait(lock, [this] { return m_closed || m_items.size() < m_capacity; });
+
+		if (m_closed) {
+			return false;
+		}
+		m_items.push_back(std::move(value));
+		lock.unlock();
+
+		m_notEmpty.notify_one();
+		return true;
+	}
+
+	// 満杯なら待たずに false。そのとき value は動かさない
+	bool tryPush(Type& value) {
+		{
+			std::lock_guard lock{ m_mutex };
+			if (m_closed || m_items.size() >= m_capacity) {
+				return false;
+			}
+			m_items.push_back(std::move(value));
+		}
+		m_notEmpty.notify_one();
+		return true;
+	}
+
+	// close() されて空になったら std::nullopt
+	std::optional<Type> pop() {
+		std::unique_lock lock{ m_mutex };
+		m_notEmpty.wait(lock, [this] { return m_closed || not m_items.empty(); });
+
+		if (m_items.empty()) {
+			return std::nullopt;
+		}
+		Type value = std::move(m_items.front());
+		m_items.pop_front();
+		lock.unlock();
+
+		m_notFull.notify_one();
+		return value;
+	}
+
+	// 以降の push() を断り、待っている側をすべて起こす。積まれている分は pop() で取り出せる
+	void close() {
+		{
+			std::lock_guard lock{ m_mutex };
+			m_closed = true;
+		}
+		m_notFull.notify_all();
+		m_notEmpty.notify_all();
+	}
+
+private:
+
+	std::mutex m_mutex;
+	std::condition_variable m_notFull;
+	std::condition_variable m_notEmpty;
+
+	std::deque<Type> m_items;
+	size_t m_capacity;
+	bool m_closed = false;
+};
@@ -0,0 +1,157 @@
+﻿# pragma once
+
+// LZMA と同じ形の2値適応レンジ符号。確率は11bitで持ち、符号化するたびに出たほうへ1/32ずつ寄せる
+namespace RangeCoder {
+
+	constexpr uint32 ProbabilityBits = 11;
+	constexpr uint16 InitialProbability = 1 << (ProbabilityBits - 1);
+	constexpr uint32 MoveBits = 5;
+	constexpr uint32 TopValue = 1u << 24;
+}
+
+class RangeEncoder
+{
+public:
+
+	void encodeBit(uint16& probability, uint32 bit) {
+		const uint32 bound = (m_range >> RangeCoder::ProbabilityBits) * probability;
+
+		if (bit == 0) {
+			m_range = bound;
+			probability += ((1 << RangeCoder::ProbabilityBits) - probability) >> RangeCoder::MoveBits;
+		}
+		else {
+			m_low += bound;
+			m_range -= bound;
+			probability -= probability >> RangeCoder::MoveBits;
+		}
+
+		normalize();
+	}
+
+	// 確率0.5で上位ビットから bits 桁
+	void encodeDirect(uint32 value, int32 bits) {
+		for (int32 k = bits - 1; k >= 0; --k) {
+			m_range >>= 1;
+			if ((value >> k) & 1) {
+				m_low += m_range;
+			}
+			normalize();
+		}
+	}
+
+	// 残りを書き出して符号列を返す
+	Array<uint8> finish() {
+		for (int32 k = 0; k < 5; ++k) {
+			shiftLow();
+		}
+		return std::move(m_bytes);
+	}
+
+private:
+
+	void normalize() {
+		while (m_range < RangeCoder::TopValue) {
+			m_range <<= 8;
+			shiftLow();
+		}
+	}
+
+	// 桁上がりが確定するまで 0xFF の並びを保留する
+	void shiftLow() {
+		if (static_cast<uint32>(m_low) < 0xFF000000u || (m_low >> 32) != 0) {
+			const uint8 carry = static_cast<uint8>(m_low >> 32);
+			uint8 pending = m_cache;
+
+			do {
+				m_bytes << static_cast<uint8>(pending + carry);
+				pending = 0xFF;
+			} while (--m_cacheSize != 0);
+
+			m_cache = static_cast<uint8>(m_low >> 24);
+		}
+
+		m_cacheSize++;
+		m_low = (m_low & 0x00FFFFFF) << 8;
+	}
+
+	uint64 m_low = 0;
+	uint32 m_range = 0xFFFFFFFF;
+	uint8 m_cache = 0;
+	uint64 m_cacheSize = 1;
+	Array<uint8> m_bytes;
+};
+
+class RangeDecoder
+{
+public:
+
+	RangeDecoder(const uint8* data, size_t size)
+		: m_data(data), m_size(size) {
+		for (int32 k = 0; k < 5; ++k) {
+			m_code = (m_code << 8) | next();
+		}
+	}
+
+	uint32 decodeBit(uint16& probability) {
+		const uint32 bound = (m_range >> RangeCoder::ProbabilityBits) * probability;
+		uint32 bit;
+
+		if (m_code < bound) {
+			m_range = bound;
+			probability += ((1 << RangeCoder::ProbabilityBits) - probability) >> RangeCoder::MoveBits;
+			bit = 0;
+		}
+		else {
+			m_code -= bound;
+			m_range -= bound;
+			probability -= probability >> RangeCoder::MoveBits;
+			bit = 1;
+		}
+
+		normalize();
+		return bit;
+	}
+
+	uint32 decodeDirect(int32 bits) {
+		uint32 result = 0;
+
+		for (int32 k = 0; k < bits; ++k) {
+			m_range >>= 1;
+
+			uint32 bit = 0;
+			if (m_code >= m_range) {
+				m_code -= m_range;
+				bit = 1;
+			}
+			result = (result << 1) | bit;
+
+			normalize();
+		}
+		return result;
+	}
+
+	// 符号列の終わりを越えて読んだか(壊れた入力)
+	bool overrun() const {
+		return m_position > m_size + 4;
+	}
+
+private:
+
+	void normalize() {
+		while (m_range < RangeCoder::TopValue) {
+			m_range <<= 8;
+			m_code = (m_code << 8) | next();
+		}
+	}
+
+	uint8 next() {
+		return m_position < m_size ? m_data[m_position++] : (m_position++, 0);
+	}
+
+	const uint8* m_data;
+	size_t m_size;
+	size_t m_position = 0;
+	uint32 m_code = 0;
+	uint32 m_range = 0xFFFFFFFF;
+};
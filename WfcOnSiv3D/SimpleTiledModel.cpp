@@ -1,9 +1,59 @@
 ﻿# include "stdafx.h"
 # include "SimpleTiledModel.hpp"
+# include "ParallelHelper.hpp"
+# include <bit>
+
+namespace {
+
+	// aは90度回転、bは反転。map[t][s] は向きtのタイルに8通りの変換sを施した向き
+	struct SymmetryClass {
+		char32 name;
+		int32 cardinality;
+		std::array<std::array<int32, 8>, 8> map;
+	};
+
+	constexpr SymmetryClass MakeSymmetry(char32 name, int32 cardinality, std::array<int32, 8> a, std::array<int32, 8> b) {
+		SymmetryClass result{ name, cardinality, {} };
+		for (int32 t = 0; t < cardinality; ++t) {
+			result.map[t] = { t, a[t], a[a[t]], a[a[a[t]]], b[t], b[a[t]], b[a[a[t]]], b[a[a[a[t]]]] };
+		}
+		return result;
+	}
+
+	constexpr std::array<SymmetryClass, 6> Symmetries{ {
+		MakeSymmetry(U'L', 4, { 1, 2, 3, 0 }, { 1, 0, 3, 2 }),
+		MakeSymmetry(U'T', 4, { 1, 2, 3, 0 }, { 0, 3, 2, 1 }),
+		MakeSymmetry(U'I', 2, { 1, 0 }, { 0, 1 }),
+		MakeSymmetry(U'\\', 2, { 1, 0 }, { 1, 0 }),
+		MakeSymmetry(U'F', 8, { 1, 2, 3, 0, 7, 4, 5, 6 }, { 4, 5, 6, 7, 0, 1, 2, 3 }),
+		MakeSymmetry(U'X', 1, { 0 }, { 0 }),
+	} };
+
+	static_assert(Symmetries[4].map[5][1] == 4);
+
+	// 該当しない記号(Xを含む)は対称性なしとして扱う
+	const SymmetryClass& FindSymmetry(const String& sym) {
+		for (const auto& symmetry : Symmetries) {
+			if (sym.size() == 1 && sym[0] == symmetry.name) {
+				return symmetry;
+			}
+		}
+		return Symmetries.back();
+	}
+}
 
-SimpleTiledModel::SimpleTiledModel(const String& jsonPath, const String& subsetName, const Size& m_gridSize, bool periodic, bool blackBackground, Heuristic heuristic)
-	: WfcModel(m_gridSize, 1, periodic, heuristic), m_blackBackground(blackBackground)
+SimpleTiledModel::SimpleTiledModel(const String& jsonPath, const String& subsetName, const Size& gridSize, bool periodic, bool blackBackground, Heuristic heuristic)
+	: SimpleTiledModel(SimpleTiledRuleSet::Load(jsonPath, subsetName), gridSize, periodic, blackBackground, heuristic) {}
+
+SimpleTiledModel::SimpleTiledModel(std::shared_ptr<const SimpleTiledRuleSet> rules, const Size& gridSize, bool periodic, bool blackBackground, Heuristic heuristic)
+	: WfcModel(rules, gridSize, 1, periodic, heuristic), m_ruleSet(std::move(rules)), m_blackBackground(blackBackground) {}
+
+std::shared_ptr<const SimpleTiledRuleSet> SimpleTiledRuleSet::Load(const String& jsonPath, const String& subsetName)
 {
+	auto rules = std::make_shared<SimpleTiledRuleSet>();
+
+	Array<String>& tilenames = rules->tilenames;
+
 	const auto jsonFileName = FileSystem::BaseName(jsonPath);
 
 	const JSON json = JSON::Load(jsonPath);
@@ -27,7 +77,8 @@ SimpleTiledModel::SimpleTiledModel(const String& jsonPath, const String& subsetN
 	}
 
 	Array<double> weightList;
-	Array<Array<int32>> action;
+	Array<SymmetryAction> action;
+	Array<TileSource> sources;
 
 	HashTable<String, int32> firstOccurrence;
 
@@ -38,103 +89,37 @@ SimpleTiledModel::SimpleTiledModel(const String& jsonPath, const String& subsetN
 			continue;
 		}
 
-		//a is 90 degrees rotation
-		std::function<int32(int32)> a;
-
-		//b is reflection
-		std::function<int32(int32)> b;
-
 		const auto sym = jTile.hasElement(U"symmetry") ? jTile[U"symmetry"].getString() : U"C";
+		const SymmetryClass& symmetry = FindSymmetry(sym);
+		const int32 cardinality = symmetry.cardinality;
 
-		int32 cardinality = 0;
-		if (sym == U"L")
-		{
-			cardinality = 4;
-			a = [](int32 i) { return (i + 1) % 4; };
-			b = [](int32 i) { return i % 2 == 0 ? i + 1 : i - 1; };
-		}
-		else if (sym == U"T")
-		{
-			cardinality = 4;
-			a = [](int32 i) { return (i + 1) % 4; };
-			b = [](int32 i) { return i % 2 == 0 ? i : 4 - i; };
-		}
-		else if (sym == U"I")
-		{
-			cardinality = 2;
-			a = [](int32 i) { return 1 - i; };
-			b = [](int32 i) { return i; };
-		}
-		else if (sym == U"\\")
-		{
-			cardinality = 2;
-			a = [](int32 i) { return 1 - i; };
-			b = [](int32 i) { return 1 - i; };
-		}
-		else if (sym == U"F")
-		{
-			cardinality = 8;
-			a = [](int32 i) { return i < 4 ? (i + 1) % 4 : 4 + (i - 1) % 4; };
-			b = [](int32 i) { return i < 4 ? i + 4 : i - 4; };
-		}
-		else
-		{
-			cardinality = 1;
-			a = [](int32 i) { return i; };
-			b = [](int32 i) { return i; };
-		}
-
-		m_T = action.size();
-		firstOccurrence.emplace(tilename, m_T);
+		const int32 first = action.size();
+		firstOccurrence.emplace(tilename, first);
 
-		Array<Array<int32>> map(cardinality, Array<int32>(8, 0));
-		for (int t = 0; t < cardinality; ++t)
+		for (int32 t = 0; t < cardinality; ++t)
 		{
-			map[t][0] = t;
-			map[t][1] = a(t);
-			map[t][2] = a(a(t));
-			map[t][3] = a(a(a(t)));
-			map[t][4] = b(t);
-			map[t][5] = b(a(t));
-			map[t][6] = b(a(a(t)));
-			map[t][7] = b(a(a(a(t))));
-
-			for (int s = 0; s < 8; ++s) {
-				map[t][s] += m_T;
+			SymmetryAction map;
+			for (int32 s = 0; s < 8; ++s) {
+				map[s] = symmetry.map[t][s] + first;
 			}
-
-			action << map[t];
+			action << map;
 		}
 
 		if (unique)
 		{
 			for (auto t = 0; t < cardinality; ++t)
 			{
-				auto x = U"tilesets/{}/{} {}.png"_fmt(jsonFileName, tilename, t);
-				auto bitmap = BitmapHelper::LoadBitmap(U"tilesets/{}/{} {}.png"_fmt(jsonFileName, tilename, t));
-				m_tilesize = bitmap.width();
-
-				m_tiles << bitmap;
-				m_tilenames << U"{} {}"_fmt(tilename, t);
+				sources << TileSource{ U"tilesets/{}/{} {}.png"_fmt(jsonFileName, tilename, t), first + t, 0 };
+				tilenames << U"{} {}"_fmt(tilename, t);
 			}
 		}
 		else
 		{
-			auto bitmap = BitmapHelper::LoadBitmap(U"tilesets/{}/{}.png"_fmt(jsonFileName, tilename));
-			m_tilesize = bitmap.width();
-
-			m_tiles << bitmap;
-			m_tilenames << U"{} 0"_fmt(tilename);
+			sources << TileSource{ U"tilesets/{}/{}.png"_fmt(jsonFileName, tilename), first, cardinality - 1 };
 
-			for (auto t = 1; t < cardinality; ++t)
+			for (auto t = 0; t < cardinality; ++t)
 			{
-				if (t <= 3) {
-					m_tiles << GridHelper::rotated270(m_tiles[m_T + t - 1]);
-				}
-				if (t >= 4) {
-					m_tiles << GridHelper::mirrored(m_tiles[m_T + t - 4]);
-				}
-				m_tilenames << U"{} {}"_fmt(tilename, t);
+				tilenames << U"{} {}"_fmt(tilename, t);
 			}
 		}
 
@@ -143,19 +128,18 @@ SimpleTiledModel::SimpleTiledModel(const String& jsonPath, const String& subsetN
 		}
 	}
 
+	const int32 T = action.size();
+	rules->weights = Array<double>(weightList);
 
-	m_T = action.size();
-	m_weights = Array<double>(weightList);
+	rules->loadAtlas(sources);
 
-	m_propagator.resize(4);
-	Array<Array<Array<bool>>> densem_propagator(4, Array<Array<bool>>(m_T, Array<bool>(m_T)));
+	// 隣接可否は [方向][タイル] ごとに T ビットの集合で持つ
+	const int32 words = (T + 63) / 64;
+	Array<uint64> dense(static_cast<size_t>(4) * T * words, 0);
 
-	for (auto d = 0; d < 4; ++d) {
-		m_propagator[d].resize(m_T);
-		for (auto t = 0; t < m_T; ++t) {
-			densem_propagator[d][t] = Array<bool>(m_T, false);
-		}
-	}
+	const auto allow = [&](int32 d, int32 t1, int32 t2) {
+		dense[(static_cast<size_t>(d) * T + t1) * words + (t2 >> 6)] |= uint64{ 1 } << (t2 & 63);
+	};
 
 	for (const auto&& [key, jNeighbor] : jroot[U"neighbors"][U"neighbor"]) {
 		const Array<String> left = jNeighbor[U"left"].getString().split(U' ');
@@ -170,115 +154,213 @@ SimpleTiledModel::SimpleTiledModel(const String& jsonPath, const String& subsetN
 		const int32 R = action[firstOccurrence[right[0]]][right.size() == 1 ? 0 : Parse<int32>(right[1])];
 		const int32 U = action[R][1];
 
-		densem_propagator[0][R][L] = true;
-		densem_propagator[0][action[R][6]][action[L][6]] = true;
-		densem_propagator[0][action[L][4]][action[R][4]] = true;
-		densem_propagator[0][action[L][2]][action[R][2]] = true;
+		allow(0, R, L);
+		allow(0, action[R][6], action[L][6]);
+		allow(0, action[L][4], action[R][4]);
+		allow(0, action[L][2], action[R][2]);
 
-		densem_propagator[1][U][D] = true;
-		densem_propagator[1][action[D][6]][action[U][6]] = true;
-		densem_propagator[1][action[U][4]][action[D][4]] = true;
-		densem_propagator[1][action[D][2]][action[U][2]] = true;
+		allow(1, U, D);
+		allow(1, action[D][6], action[U][6]);
+		allow(1, action[U][4], action[D][4]);
+		allow(1, action[D][2], action[U][2]);
 	}
 
-	for (auto t2 = 0; t2 < m_T; ++t2) {
-		for (auto t1 = 0; t1 < m_T; ++t1) {
-			densem_propagator[2][t2][t1] = densem_propagator[0][t1][t2];
-			densem_propagator[3][t2][t1] = densem_propagator[1][t1][t2];
+	// 方向2,3は0,1の転置
+	for (int32 t1 = 0; t1 < T; ++t1) {
+		for (int32 d = 0; d < 2; ++d) {
+			const uint64* row = &dense[(static_cast<size_t>(d) * T + t1) * words];
+
+			for (int32 k = 0; k < words; ++k) {
+				for (uint64 bits = row[k]; bits != 0; bits &= bits - 1) {
+					allow(d + 2, k * 64 + std::countr_zero(bits), t1);
+				}
+			}
 		}
 	}
 
+	auto& propagator = rules->propagator;
+	propagator.assign(4, Array<Array<int32>>(T));
+
+	for (int32 d = 0; d < 4; ++d) {
+		for (int32 t1 = 0; t1 < T; ++t1) {
+			const uint64* row = &dense[(static_cast<size_t>(d) * T + t1) * words];
+
+			int32 count = 0;
+			for (int32 k = 0; k < words; ++k) {
+				count += std::popcount(row[k]);
+			}
+
+			if (count == 0) {
+				std::cout << "ERROR: tile " << tilenames[t1] << " has no neighbors in direction " << d << std::endl;
+			}
 
-	Array<Array<Array<int32>>> sparsem_propagator(4, Array<Array<int32>>(m_T));
-	for (auto d = 0; d < 4; ++d) {
-		for (auto t = 0; t < m_T; ++t) {
-			sparsem_propagator[d][t] = Array<int>();
+			Array<int32>& list = propagator[d][t1];
+			list.reserve(count);
+			for (int32 k = 0; k < words; ++k) {
+				for (uint64 bits = row[k]; bits != 0; bits &= bits - 1) {
+					list << k * 64 + std::countr_zero(bits);
+				}
+			}
 		}
 	}
 
-	for (auto d = 0; d < 4; ++d) {
-		for (auto t1 = 0; t1 < m_T; ++t1) {
-			Array<int32>& sp = sparsem_propagator[d][t1];
-			Array<bool>& tp = densem_propagator[d][t1];
+	rules->finalize();
+	return rules;
+}
+
+void SimpleTiledRuleSet::loadAtlas(const Array<TileSource>& sources)
+{
+	// PNGの読み込みはファイルごとに並列に行い、サイズが揃ってから1枚の連続領域に展開する
+	Array<Grid<Color>> decoded(sources.size());
+	ParallelHelper::For(static_cast<int32>(sources.size()), [&](int32 k) {
+		decoded[k] = BitmapHelper::LoadBitmap(sources[k].path);
+	});
+
+	tilesize = decoded.isEmpty() ? 0 : static_cast<int32>(decoded.back().width());
 
-			for (int32 t2 = 0; t2 < m_T; ++t2) {
-				if (tp[t2]) {
-					sp << (t2);
+	const size_t tilePixels = static_cast<size_t>(tilesize) * tilesize;
+	atlas.assign(tilePixels * tilenames.size(), Color{});
+
+	ParallelHelper::For(static_cast<int32>(sources.size()), [&](int32 k) {
+		const TileSource& source = sources[k];
+		const Grid<Color>& bitmap = decoded[k];
+
+		Color* dst = &atlas[source.tile * tilePixels];
+		for (int32 y = 0; y < tilesize; ++y) {
+			std::memcpy(dst + y * tilesize, &bitmap[y][0], sizeof(Color) * tilesize);
+		}
+
+		// 1〜3枚目は直前のタイルを270度回転、4枚目以降は4つ前のタイルの左右反転
+		for (int32 t = 1; t <= source.derived; ++t) {
+			const Color* src = &atlas[(source.tile + (t <= 3 ? t - 1 : t - 4)) * tilePixels];
+			Color* out = &atlas[(source.tile + t) * tilePixels];
+
+			for (int32 y = 0; y < tilesize; ++y) {
+				for (int32 x = 0; x < tilesize; ++x) {
+					out[y * tilesize + x] = t <= 3 ? src[x * tilesize + (tilesize - 1 - y)] : src[y * tilesize + (tilesize - 1 - x)];
 				}
 			}
+		}
+	});
+}
 
-			const int32 ST = sp.size();
-			if (ST == 0) {
-				std::cout << "ERROR: tile " << m_tilenames[t1] << " has no neighbors in direction " << d << std::endl;
-			}
+int32 SimpleTiledRuleSet::tileIndex(const String& tilename) const
+{
+	const String fullname = tilename.contains(U' ') ? tilename : U"{} 0"_fmt(tilename);
 
-			m_propagator[d][t1].resize(ST);
-			for (int st = 0; st < ST; ++st) {
-				m_propagator[d][t1][st] = sp[st];
-			}
+	for (int32 t = 0; t < tilenames.size(); ++t) {
+		if (tilenames[t] == fullname) {
+			return t;
 		}
 	}
+	return -1;
 }
 
 Image SimpleTiledModel::toImage() const
 {
-	Grid<Color> bitmapData(m_gridSize * m_tilesize);
-	if (m_observed[0][0] >= 0)
+	const int32 tilesize = m_ruleSet->tilesize;
+
+	Image image{ m_gridSize * tilesize };
+	if (tilesize == 0) {
+		return image;
+	}
+
+	// セル行単位でスレッドに分ける。1区間あたりおよそ64K画素以上にする
+	const int32 pixelsPerCellRow = m_gridSize.x * tilesize * tilesize;
+	const int32 minRows = Max(1, 65536 / Max(pixelsPerCellRow, 1));
+
+	if (isObservationStored())
 	{
-		for (int32 x = 0; x < m_gridSize.x; ++x) {
-			for (int32 y = 0; y < m_gridSize.y; ++y)
-			{
-				const auto& tile = m_tiles[m_observed[y][x]];
-				for (int32 dy = 0; dy < m_tilesize; ++dy) {
-					for (int32 dx = 0; dx < m_tilesize; ++dx) {
-						const auto& pixel = tile[dy][dx];
-						bitmapData[y * m_tilesize + dy][x * m_tilesize + dx] = pixel;
-					}
-				}
-			}
-		}
+		ParallelHelper::ForRange(m_gridSize.y, minRows, [&](int32 y0, int32 y1) {
+			RenderObservedRows(*m_ruleSet, m_observed, m_gridSize, image, y0, y1);
+		});
 	}
 	else
 	{
-		for (auto x : step(m_wave.height())) {
-			for (auto y : step(m_wave.width())) {
-				if (m_blackBackground && m_sumsOfOnes[y][x] == m_T) {
-					for (int32 yt = 0; yt < m_tilesize; ++yt) {
-						for (int32 xt = 0; xt < m_tilesize; ++xt) {
-							bitmapData[y * m_tilesize + yt][x * m_tilesize + xt] = Color(0, 0, 0, 255);
-						}
-					}
+		ParallelHelper::ForRange(m_gridSize.y, minRows, [&](int32 y0, int32 y1) {
+			renderSuperposedRows(image, y0, y1);
+		});
+	}
+	return image;
+}
+
+Image SimpleTiledModel::RenderObserved(const SimpleTiledRuleSet& rules, const Array<int32>& observed, const Size& gridSize)
+{
+	Image image{ gridSize * rules.tilesize };
+	RenderObservedRows(rules, observed, gridSize, image, 0, gridSize.y);
+	return image;
+}
+
+void SimpleTiledModel::RenderObservedRows(const SimpleTiledRuleSet& rules, const Array<int32>& observed, const Size& gridSize, Image& image, int32 y0, int32 y1)
+{
+	const int32 tilesize = rules.tilesize;
+	const size_t rowBytes = sizeof(Color) * tilesize;
+
+	for (int32 y = y0; y < y1; ++y) {
+		for (int32 dy = 0; dy < tilesize; ++dy) {
+			Color* dst = image[static_cast<size_t>(y) * tilesize + dy];
+
+			for (int32 x = 0; x < gridSize.x; ++x) {
+				const Color* src = rules.tilePixels(observed[Topology2D::Index(gridSize, { x, y })]) + dy * tilesize;
+				std::memcpy(dst + x * tilesize, src, rowBytes);
+			}
+		}
+	}
+}
+
+void SimpleTiledModel::renderSuperposedRows(Image& image, int32 y0, int32 y1) const
+{
+	// 重みは合計が 1 << PreviewShift になる固定小数点で持ち、画素値との積を整数で足し込む
+	constexpr int32 PreviewShift = 16;
+
+	const int32 tilesize = m_ruleSet->tilesize;
+	const int32 tilePixels = tilesize * tilesize;
+	const auto& weights = m_ruleSet->weights;
+
+	Array<uint32> accumulator(static_cast<size_t>(tilePixels) * 3);
+
+	for (int32 y = y0; y < y1; ++y) {
+		for (int32 x = 0; x < m_gridSize.x; ++x) {
+			const int32 i = cellIndex({ x, y });
+
+			if (m_blackBackground && m_sumsOfOnes[i] == m_T) {
+				for (int32 yt = 0; yt < tilesize; ++yt) {
+					std::fill_n(image[static_cast<size_t>(y) * tilesize + yt] + x * tilesize, tilesize, Color(0, 0, 0, 255));
+				}
+				continue;
+			}
+
+			const double normalization = (1 << PreviewShift) / sumOfWeightsAt(i);
+			std::fill(accumulator.begin(), accumulator.end(), 0);
+
+			for (int32 t = 0; t < m_T; ++t) {
+				if (not isPossible(i, t)) {
+					continue;
 				}
-				else
-				{
-					Array<bool> w = m_wave[y][x];
-					double normalization{ 1.0 / m_sumsOfWeights[y][x] };
-					for (int32 yt = 0; yt < m_tilesize; ++yt) {
-						for (int32 xt = 0; xt < m_tilesize; ++xt) {
-							double r{ 0 };
-							double g{ 0 };
-							double b{ 0 };
-
-							for (int32 t = 0; t < m_T; ++t) {
-								if (w[t])
-								{
-									const auto& argb = m_tiles[t][yt][xt];
-									r += argb.r * m_weights[t] * normalization;
-									g += argb.g * m_weights[t] * normalization;
-									b += argb.b * m_weights[t] * normalization;
-								}
-							}
-							bitmapData[y * m_tilesize + yt][x * m_tilesize + xt] =
-								Color(
-									static_cast<uint8>(r),
-									static_cast<uint8>(g),
-									static_cast<uint8>(b)
-								);
-						}
-					}
+
+				const uint32 w = static_cast<uint32>(weights[t] * normalization);
+				const Color* src = m_ruleSet->tilePixels(t);
+				uint32* acc = accumulator.data();
+
+				for (int32 k = 0; k < tilePixels; ++k) {
+					acc[k * 3 + 0] += src[k].r * w;
+					acc[k * 3 + 1] += src[k].g * w;
+					acc[k * 3 + 2] += src[k].b * w;
+				}
+			}
+
+			for (int32 yt = 0; yt < tilesize; ++yt) {
+				Color* dst = image[static_cast<size_t>(y) * tilesize + yt] + x * tilesize;
+				const uint32* acc = &accumulator[static_cast<size_t>(yt) * tilesize * 3];
+
+				for (int32 xt = 0; xt < tilesize; ++xt) {
+					dst[xt] = Color(
+						static_cast<uint8>(Min<uint32>(acc[xt * 3 + 0] >> PreviewShift, 255)),
+						static_cast<uint8>(Min<uint32>(acc[xt * 3 + 1] >> PreviewShift, 255)),
+						static_cast<uint8>(Min<uint32>(acc[xt * 3 + 2] >> PreviewShift, 255))
+					);
 				}
 			}
 		}
 	}
-	return BitmapHelper::ToImage(bitmapData);
 }
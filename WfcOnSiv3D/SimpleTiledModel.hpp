@@ -4,27 +4,77 @@
 # include "GridHelper.h"
 
 # pragma once
+// タイルセットJSONから読み込んだ規則。読み込み後は複数のSimpleTiledModelで共有できる
+struct SimpleTiledRuleSet : WfcRuleSet {
+
+	// タイルtの画素は atlas[t * tilesize * tilesize] から行順に tilesize × tilesize 個並ぶ
+	Array<Color> atlas;
+
+	Array<String> tilenames;
+
+	int32 tilesize = 0;
+
+	inline const Color* tilePixels(int32 t) const {
+		return &atlas[static_cast<size_t>(t) * tilesize * tilesize];
+	}
+
+	// "名前 番号" 形式(番号省略時は0)のタイル名からタイル番号を引く。見つからなければ-1
+	int32 tileIndex(const String& tilename) const;
+
+	static std::shared_ptr<const SimpleTiledRuleSet> Load(const String& jsonPath, const String& subsetName);
+
+private:
+
+	// 変換0〜7を施したときのタイル番号
+	using SymmetryAction = std::array<int32, 8>;
+
+	// 1枚のPNGと、そこから回転・反転で作る後続タイルの枚数
+	struct TileSource {
+		FilePath path;
+		int32 tile;
+		int32 derived;
+	};
+
+	void loadAtlas(const Array<TileSource>& sources);
+};
+
 class SimpleTiledModel : public WfcModel
 {
 public:
 
 	SimpleTiledModel(const String& jsonPath, const String& subsetName, const Size& gridSize, bool periodic, bool blackBackground, Heuristic heuristic);
 
+	SimpleTiledModel(std::shared_ptr<const SimpleTiledRuleSet> rules, const Size& gridSize, bool periodic, bool blackBackground, Heuristic heuristic);
+
 	Image toImage() const;
 
+	// 完了した observed() の内容を1スレッドで描く。モデルを持たずに描けるので、書き出しスレッドから呼べる
+	static Image RenderObserved(const SimpleTiledRuleSet& rules, const Array<int32>& observed, const Size& gridSize);
+
+	inline int32 tileIndex(const String& tilename) const {
+		return m_ruleSet->tileIndex(tilename);
+	}
+
 	inline int32 tilesize() const {
-		return m_tilesize;
+		return m_ruleSet->tilesize;
 	}
 
 	inline Size imageSize() const
 	{
-		return m_gridSize * m_tilesize;
+		return m_gridSize * m_ruleSet->tilesize;
 	}
 
+	inline const std::shared_ptr<const SimpleTiledRuleSet>& ruleSet() const
+	{
+		return m_ruleSet;
+	}
 
 private:
-	Array<Grid<Color>> m_tiles;
-	Array<String> m_tilenames;
-	int32 m_tilesize = 0;
+	// セル行 [y0, y1) の分だけ画像に書き込む
+	static void RenderObservedRows(const SimpleTiledRuleSet& rules, const Array<int32>& observed, const Size& gridSize, Image& image, int32 y0, int32 y1);
+
+	void renderSuperposedRows(Image& image, int32 y0, int32 y1) const;
+
+	std::shared_ptr<const SimpleTiledRuleSet> m_ruleSet;
 	bool m_blackBackground;
 };
@@ -0,0 +1,90 @@
+﻿# include "stdafx.h"
+# include "VoxelTiledModel.hpp"
+
+VoxelTiledModel::VoxelTiledModel(const String& jsonPath, const Extent& gridSize, bool periodic, Heuristic heuristic)
+	: VoxelTiledModel(VoxelTiledRuleSet::Load(jsonPath), gridSize, periodic, heuristic) {}
+
+VoxelTiledModel::VoxelTiledModel(std::shared_ptr<const VoxelTiledRuleSet> rules, const Extent& gridSize, bool periodic, Heuristic heuristic)
+	: WfcModel3D(rules, gridSize, 1, periodic, heuristic), m_ruleSet(std::move(rules)) {}
+
+std::shared_ptr<const VoxelTiledRuleSet> VoxelTiledRuleSet::Load(const String& jsonPath)
+{
+	auto rules = std::make_shared<VoxelTiledRuleSet>();
+
+	const JSON json = JSON::Load(jsonPath);
+	const JSON& jroot = json[U"set"];
+
+	Array<double> weightList;
+
+	for (const auto&& [key, jTile] : jroot[U"tiles"][U"tile"]) {
+		rules->tilenames << jTile[U"name"].getString();
+		weightList << (jTile.hasElement(U"weight") ? jTile[U"weight"].get<double>() : 1.0);
+	}
+
+	const int32 T = rules->tilenames.size();
+	rules->weights = weightList;
+
+	// 軸ごとに「負側のタイル」「正側のタイル」と、正側を向く方向
+	struct Axis {
+		String lower;
+		String upper;
+		int32 direction;
+	};
+
+	static const Array<Axis> axes{
+		{ U"left", U"right", 2 },
+		{ U"bottom", U"top", 1 },
+		{ U"back", U"front", 4 },
+	};
+
+	Array<Array<bool>> dense(Topology3D::Directions, Array<bool>(T * T, false));
+
+	for (const auto&& [key, jNeighbor] : jroot[U"neighbors"][U"neighbor"]) {
+		for (const auto& axis : axes) {
+			if (not jNeighbor.hasElement(axis.lower) || not jNeighbor.hasElement(axis.upper)) {
+				continue;
+			}
+
+			const int32 lower = rules->tileIndex(jNeighbor[axis.lower].getString());
+			const int32 upper = rules->tileIndex(jNeighbor[axis.upper].getString());
+
+			if (lower < 0 || upper < 0) {
+				std::cout << "ERROR: unknown tile in neighbor " << jNeighbor[axis.lower].getString() << " / " << jNeighbor[axis.upper].getString() << std::endl;
+				continue;
+			}
+
+			dense[axis.direction][lower * T + upper] = true;
+			dense[Topology3D::Opposite[axis.direction]][upper * T + lower] = true;
+		}
+	}
+
+	auto& propagator = rules->propagator;
+	propagator.resize(Topology3D::Directions);
+	for (int32 d = 0; d < Topology3D::Directions; ++d) {
+		propagator[d].resize(T);
+		for (int32 t1 = 0; t1 < T; ++t1) {
+			for (int32 t2 = 0; t2 < T; ++t2) {
+				if (dense[d][t1 * T + t2]) {
+					propagator[d][t1] << t2;
+				}
+			}
+
+			if (propagator[d][t1].isEmpty()) {
+				std::cout << "ERROR: tile " << rules->tilenames[t1] << " has no neighbors in direction " << d << std::endl;
+			}
+		}
+	}
+
+	rules->finalize();
+	return rules;
+}
+
+int32 VoxelTiledRuleSet::tileIndex(const String& tilename) const
+{
+	for (int32 t = 0; t < tilenames.size(); ++t) {
+		if (tilenames[t] == tilename) {
+			return t;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,46 @@
+﻿# pragma once
+# include "WfcModel.hpp"
+
+// 6近傍の3Dボクセル用タイル規則
+// JSONは set/tiles/tile に name と weight、set/neighbors/neighbor に
+// left/right(x軸)、bottom/top(y軸)、back/front(z軸) のいずれかの組を並べる。対称性による展開はしない
+struct VoxelTiledRuleSet : WfcRuleSet {
+
+	Array<String> tilenames;
+
+	int32 tileIndex(const String& tilename) const;
+
+	static std::shared_ptr<const VoxelTiledRuleSet> Load(const String& jsonPath);
+};
+
+class VoxelTiledModel : public WfcModel3D
+{
+public:
+
+	VoxelTiledModel(const String& jsonPath, const Extent& gridSize, bool periodic, Heuristic heuristic);
+
+	VoxelTiledModel(std::shared_ptr<const VoxelTiledRuleSet> rules, const Extent& gridSize, bool periodic, Heuristic heuristic);
+
+	inline int32 tileIndex(const String& tilename) const {
+		return m_ruleSet->tileIndex(tilename);
+	}
+
+	inline const String& tilename(int32 t) const {
+		return m_ruleSet->tilenames[t];
+	}
+
+	inline int32 observedTile(const Position& p) const {
+		return m_observed[cellIndex(p)];
+	}
+
+	inline const Extent& volumeSize() const {
+		return m_gridSize;
+	}
+
+	inline const std::shared_ptr<const VoxelTiledRuleSet>& ruleSet() const {
+		return m_ruleSet;
+	}
+
+private:
+	std::shared_ptr<const VoxelTiledRuleSet> m_ruleSet;
+};
@@ -1,243 +1,1707 @@
 ﻿# include "stdafx.h"
 # include "WfcModel.hpp"
+# include <bit>
+# include <algorithm>
+# include <limits>
+# include <type_traits>
+# include <utility>
 
-WfcModel::WfcModel(const Size& gridSize, int32 N, bool periodic, Heuristic heuristic):
-	m_gridSize(gridSize), m_N(N), m_periodic(periodic), m_heuristic(heuristic),
-	m_observed(gridSize), m_sumsOfOnes(gridSize), m_sumsOfWeights(gridSize), m_sumsOfWeightLogWeights(gridSize), m_entropies(gridSize) {}
+namespace {
 
-void WfcModel::init()
+	constexpr uint32 ResultMagic = 0x52434657; // "WFCR"
+	constexpr uint16 ResultVersion = 1;
+
+	// 候補数の桁数ごとに番号の前置部の確率を分ける
+	constexpr int32 ResultContexts = 17;
+	constexpr int32 MaxPrefixBits = 31;
+
+	std::array<int32, 3> ExtentValues(const Size& size) {
+		return { size.x, size.y, 1 };
+	}
+
+	std::array<int32, 3> ExtentValues(const Topology3D::Extent& size) {
+		return { size.x, size.y, size.z };
+	}
+
+	// ヘッダの数値はホストのバイト順によらず、下位バイトから順に書く(リトルエンディアン)
+	template <class Value>
+	void Append(Array<uint8>& bytes, Value value) {
+		const auto bits = static_cast<std::make_unsigned_t<Value>>(value);
+		for (size_t k = 0; k < sizeof(Value); k++) {
+			bytes << static_cast<uint8>(bits >> (k * 8));
+		}
+	}
+
+	template <class Value, size_t Size>
+	void Append(Array<uint8>& bytes, const std::array<Value, Size>& values) {
+		for (const Value value : values) {
+			Append(bytes, value);
+		}
+	}
+
+	template <class Value>
+	bool Read(const uint8*& p, const uint8* end, Value& value) {
+		if (static_cast<size_t>(end - p) < sizeof(Value)) {
+			return false;
+		}
+
+		using Bits = std::make_unsigned_t<Value>;
+		Bits bits = 0;
+		for (size_t k = 0; k < sizeof(Value); k++) {
+			bits = static_cast<Bits>(bits | (static_cast<Bits>(p[k]) << (k * 8)));
+		}
+		value = static_cast<Value>(bits);
+		p += sizeof(Value);
+		return true;
+	}
+
+	template <class Value, size_t Size>
+	bool Read(const uint8*& p, const uint8* end, std::array<Value, Size>& values) {
+		for (Value& value : values) {
+			if (not Read(p, end, value)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// salt とセル番号から決まる [0, 1) の値(SplitMix64)
+	double CellNoise(uint64 salt, int32 i) {
+		uint64 z = salt + static_cast<uint64>(i) * 0x9e3779b97f4a7c15;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		z ^= z >> 31;
+		return static_cast<double>(z >> 11) * 0x1.0p-53;
+	}
+
+	// 走査順で先に決まった隣(-x, -y, -z)のタイルから置けるタイルを絞り、重みの大きい順に並べた中での番号を符号化する
+	// 多くのセルでは候補が1つに決まるので、ほぼ0ビットで済む。候補にない値は番号=候補数に続けてタイル番号をそのまま書く
+	template <class Topology>
+	class ResultCoder
+	{
+	public:
+
+		ResultCoder(const WfcRuleSet& rules, const typename Topology::Extent& gridSize)
+			: m_gridSize(gridSize), m_T(rules.T), m_tileBits(std::bit_width(static_cast<uint32>(Max(rules.T - 1, 0)))) {
+			m_byRank.resize(m_T);
+			for (int32 t = 0; t < m_T; t++) {
+				m_byRank[t] = t;
+			}
+			std::stable_sort(m_byRank.begin(), m_byRank.end(), [&](int32 a, int32 b) { return rules.weights[a] > rules.weights[b]; });
+
+			m_rank.resize(m_T);
+			for (int32 r = 0; r < m_T; r++) {
+				m_rank[m_byRank[r]] = r;
+			}
+			m_all.resize(m_T);
+			for (int32 r = 0; r < m_T; r++) {
+				m_all[r] = r;
+			}
+
+			m_allowed.resize(Topology::Directions);
+			for (int32 d = 0; d < Topology::Directions; d++) {
+				if (Topology::Index(gridSize, Topology::Offsets[d]) >= 0) {
+					continue;
+				}
+				m_priorDirections << d;
+
+				// 方向dの隣がタイルtのとき、このセルに置けるタイルの順位
+				m_allowed[d].resize(m_T);
+				for (int32 t = 0; t < m_T; t++) {
+					rules.eachCompatible(Topology::Opposite[d], t, [&](int32 t2) {
+						m_allowed[d][t] << m_rank[t2];
+					});
+					std::sort(m_allowed[d][t].begin(), m_allowed[d][t].end());
+				}
+			}
+
+			for (auto& prefix : m_prefix) {
+				prefix.fill(RangeCoder::InitialProbability);
+			}
+		}
+
+		void encode(RangeEncoder& encoder, const Array<int32>& observed, int32 i) {
+			const Array<int32>& candidates = candidatesAt(observed, i);
+			const int32 count = static_cast<int32>(candidates.size());
+			const int32 t = observed[i];
+
+			int32 index = count;
+			if (t >= 0 && t < m_T) {
+				const auto it = std::lower_bound(candidates.begin(), candidates.end(), m_rank[t]);
+				if (it != candidates.end() && *it == m_rank[t]) {
+					index = static_cast<int32>(it - candidates.begin());
+				}
+			}
+
+			if (count > 0) {
+				encodeIndex(encoder, context(count), index);
+			}
+			if (index == count) {
+				encoder.encodeDirect(static_cast<uint32>(t), m_tileBits);
+			}
+		}
+
+		// 壊れた入力では範囲外の値を返すことがある
+		int32 decode(RangeDecoder& decoder, const Array<int32>& observed, int32 i) {
+			const Array<int32>& candidates = candidatesAt(observed, i);
+			const int32 count = static_cast<int32>(candidates.size());
+
+			const int32 index = count > 0 ? decodeIndex(decoder, context(count)) : 0;
+			if (index < count) {
+				return m_byRank[candidates[index]];
+			}
+			if (index == count) {
+				return static_cast<int32>(decoder.decodeDirect(m_tileBits));
+			}
+			return -1;
+		}
+
+	private:
+
+		static int32 context(int32 count) {
+			return Min(static_cast<int32>(std::bit_width(static_cast<uint32>(count))), ResultContexts - 1);
+		}
+
+		// 指数ゴロム符号。桁数を適応的に、残りの桁はそのまま書く
+		void encodeIndex(RangeEncoder& encoder, int32 ctx, int32 index) {
+			const uint32 n = static_cast<uint32>(index) + 1;
+			const int32 k = static_cast<int32>(std::bit_width(n)) - 1;
+
+			for (int32 j = 0; j < k; j++) {
+				encoder.encodeBit(m_prefix[ctx][j], 1);
+			}
+			if (k < MaxPrefixBits) {
+				encoder.encodeBit(m_prefix[ctx][k], 0);
+			}
+			encoder.encodeDirect(n & ((uint32{ 1 } << k) - 1), k);
+		}
+
+		int32 decodeIndex(RangeDecoder& decoder, int32 ctx) {
+			int32 k = 0;
+			while (k < MaxPrefixBits && decoder.decodeBit(m_prefix[ctx][k])) {
+				k++;
+			}
+			const uint32 n = (uint32{ 1 } << k) | decoder.decodeDirect(k);
+			return static_cast<int32>(Min<uint32>(n - 1, INT32_MAX));
+		}
+
+		// セルiに置けるタイルの順位(昇順)。先に決まった隣がなければ全タイル
+		const Array<int32>& candidatesAt(const Array<int32>& observed, int32 i) {
+			const auto p = Topology::Coordinates(m_gridSize, i);
+			const Array<int32>* current = &m_all;
+			int32 next = 0;
+
+			for (const int32 d : m_priorDirections) {
+				const int32 j = Topology::Neighbor(m_gridSize, 1, false, p, d);
+				if (j < 0 || observed[j] < 0 || observed[j] >= m_T) {
+					continue;
+				}
+
+				const Array<int32>& allowed = m_allowed[d][observed[j]];
+				if (current == &m_all) {
+					current = &allowed;
+					continue;
+				}
+
+				Array<int32>& buffer = m_buffers[next];
+				next ^= 1;
+				buffer.clear();
+				std::set_intersection(current->begin(), current->end(), allowed.begin(), allowed.end(), std::back_inserter(buffer));
+				current = &buffer;
+			}
+
+			return *current;
+		}
+
+		typename Topology::Extent m_gridSize;
+		int32 m_T;
+		int32 m_tileBits;
+
+		Array<int32> m_rank;
+		Array<int32> m_byRank;
+		Array<int32> m_all;
+		Array<int32> m_priorDirections;
+		Array<Array<Array<int32>>> m_allowed;
+		std::array<Array<int32>, 2> m_buffers;
+
+		std::array<std::array<uint16, MaxPrefixBits>, ResultContexts> m_prefix;
+	};
+}
+
+template <class Topology>
+BasicWfcModel<Topology>::BasicWfcModel(std::shared_ptr<const WfcRuleSet> rules, const Extent& gridSize, int32 N, bool periodic, Heuristic heuristic):
+	m_rules(std::move(rules)), m_observed(Topology::CellCount(gridSize), -1), m_gridSize(gridSize), m_T(m_rules->T), m_N(N), m_periodic(periodic), m_heuristic(heuristic) {}
+
+template <class Topology>
+void BasicWfcModel<Topology>::init()
 {
-	m_wave.resize(m_gridSize, Array<bool>(m_T));
-	m_compatible.resize(m_wave.size(), Array<Array<int32>>(m_T, Array<int32>(4)));
+	// 汎用カーネルは支持数を int16 で数えるので、数えきれない規則は受け付けない
+	if (not m_rules->isSingleWord()) {
+		int32 maxCount = 0;
+		for (int32 t = 0; t < m_T; t++) {
+			for (int32 d = 0; d < Directions; d++) {
+				maxCount = Max(maxCount, m_rules->compatibleCount(d, t));
+			}
+		}
+
+		if (maxCount > std::numeric_limits<int16>::max()) {
+			std::cout << "ERROR: a tile has " << maxCount << " compatible neighbors, more than the support counters can hold" << std::endl;
+			m_initialized = false;
+			return;
+		}
+	}
+
+	const size_t cells = cellCount();
+
+	m_kernel = m_rules->isSingleWord() ? Kernel::SingleWord : Kernel::Generic;
+	m_waveWords = (m_T + 63) / 64;
+
+	// 大規模モードでは領域を必要になった分だけ割り当てる
+	const size_t slots = m_largeGrid ? 0 : cells;
+	m_wave.assign(slots * m_waveWords, 0);
+
+	if (m_kernel == Kernel::SingleWord) {
+		m_compatible.clear();
+		m_initialCompatible.clear();
+	}
+	else {
+		m_initialCompatible.resize(m_T * Directions);
+		for (int32 t = 0; t < m_T; t++) {
+			for (int32 d = 0; d < Directions; d++) {
+				m_initialCompatible[t * Directions + d] = static_cast<int16>(m_rules->compatibleCount(Topology::Opposite[d], t));
+			}
+		}
+
+		m_compatible.resize(slots * m_T * Directions);
+	}
+
+	m_observed.resize(cells);
+	m_sumsOfOnes.resize(cells);
+	m_sumsOfWeights.resize(slots);
+	m_sumsOfWeightLogWeights.resize(slots);
+	m_entropies.resize(slots);
+
+	m_slotOf.assign(m_largeGrid ? cells : 0, -1);
+	m_freeSlots.clear();
+	m_slotCount = static_cast<int32>(slots);
 	m_distribution.resize(m_T);
 
-	m_weightLogWeights.resize(m_T);
-	m_sumOfWeights = 0;
-	m_sumOfWeightLogWeights = 0;
+	m_contradictionCounts.assign(cells, 0);
+
+	// 大規模モードではセルあたりのメモリを増やさないよう表を作らない
+	m_neighbors.clear();
+	if (not m_largeGrid) {
+		m_neighbors.resize(cells * Directions);
+		for (size_t i = 0; i < cells; i++) {
+			const Position p = Topology::Coordinates(m_gridSize, static_cast<int32>(i));
+			for (int32 d = 0; d < Directions; d++) {
+				m_neighbors[i * Directions + d] = Topology::Neighbor(m_gridSize, m_N, m_periodic, p, d);
+			}
+		}
+	}
+
+	m_frontier.clear();
+	m_frontierIndex.assign(m_heuristic == Heuristic::Frontier ? cells : 0, -1);
+
+	//最悪ケース(セル数×T)は確保せず、必要に応じて伸長させる
+	m_stack.clear();
+	m_stack.reserve(cells);
+
+	m_hasInitialState = false;
+	m_initialized = true;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::clear() {
+	if (not m_initialized) {
+		return;
+	}
+
+	m_stack.clear();
+	m_contradiction = -1;
+
+	if (m_hasInitialState) {
+		restoreInitialState();
+
+		if (m_listener) {
+			m_listener->onCleared();
+
+			if (not m_initialState.bans.isEmpty()) {
+				m_listener->onBanned(m_initialState.bans);
+			}
+			if (not m_constraintsSatisfiable && m_initialState.contradiction >= 0) {
+				m_listener->onContradiction(m_initialState.contradiction);
+			}
+		}
+		return;
+	}
+
+	const int32 cells = cellCount();
+
+	if (m_largeGrid) {
+		// 容量は残したまま全領域を空きに戻す
+		m_slotOf.fill(-1);
+		m_freeSlots.clear();
+		m_slotCount = 0;
+		m_wave.clear();
+		m_compatible.clear();
+		m_sumsOfWeights.clear();
+		m_sumsOfWeightLogWeights.clear();
+		m_entropies.clear();
+	}
+
+	for (int32 i = 0; i < cells; i++) {
+		if (not m_largeGrid) {
+			resetSlot(i);
+		}
+
+		m_sumsOfOnes[i] = m_T;
+		m_observed[i] = -1;
+	}
+	m_frontier.clear();
+	m_frontierIndex.fill(-1);
+	m_collapsed.clear();
+	m_banLog.clear();
+	m_observationStored = false;
+	m_observedSoFar = 0;
+	m_constraintsSatisfiable = true;
+
+	if (m_listener) {
+		m_listener->onCleared();
+	}
+
+	//制約はすべてbanしてから1回だけ伝播する
+	if (m_ground) {
+		Array<bool> ground(m_T, false);
+		ground[m_T - 1] = true;
+
+		Array<bool> air(m_T, true);
+		air[m_T - 1] = false;
+
+		applyConstraint(Topology::GroundRegion(m_gridSize), ground);
+		applyConstraint(Topology::AboveGroundRegion(m_gridSize), air);
+	}
+
+	for (const auto& constraint : m_constraints) {
+		applyConstraint(constraint.region, constraint.allowed);
+	}
+
+	if (m_ground || not m_constraints.isEmpty()) {
+		m_constraintsSatisfiable = propagate();
+	}
+
+	// 制約で絞られただけのセルは Frontier の起点にしない。最初の観測から育てる
+	m_frontier.clear();
+	m_frontierIndex.fill(-1);
+
+	// 制約がなくても、次回からは見本1つからの複写で済む
+	saveInitialState();
+
+	notifyPropagated(m_constraintsSatisfiable);
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::resetSlot(int32 s) {
+	uint64* w = &m_wave[static_cast<size_t>(s) * m_waveWords];
+	for (int32 k = 0; k < m_waveWords; k++) {
+		const int32 rest = m_T - k * 64;
+		w[k] = rest >= 64 ? ~uint64{ 0 } : (uint64{ 1 } << rest) - 1;
+	}
+
+	if (m_kernel == Kernel::Generic) {
+		std::copy(m_initialCompatible.begin(), m_initialCompatible.end(), m_compatible.begin() + static_cast<size_t>(s) * m_T * Directions);
+	}
+
+	m_sumsOfWeights[s] = m_rules->sumOfWeights;
+	m_sumsOfWeightLogWeights[s] = m_rules->sumOfWeightLogWeights;
+	m_entropies[s] = m_rules->startingEntropy;
+}
+
+template <class Topology>
+int32 BasicWfcModel<Topology>::ensureSlot(int32 i) {
+	if (not m_largeGrid) {
+		return i;
+	}
+
+	if (m_slotOf[i] >= 0) {
+		return m_slotOf[i];
+	}
+
+	if (m_freeSlots.isEmpty()) {
+		const int32 first = m_slotCount;
+		m_slotCount += SlotsPerPage;
+
+		m_wave.resize(static_cast<size_t>(m_slotCount) * m_waveWords);
+		if (m_kernel == Kernel::Generic) {
+			m_compatible.resize(static_cast<size_t>(m_slotCount) * m_T * Directions);
+		}
+		m_sumsOfWeights.resize(m_slotCount);
+		m_sumsOfWeightLogWeights.resize(m_slotCount);
+		m_entropies.resize(m_slotCount);
+
+		for (int32 s = m_slotCount - 1; s >= first; s--) {
+			m_freeSlots << s;
+		}
+	}
+
+	const int32 s = m_freeSlots.back();
+	m_freeSlots.pop_back();
+
+	m_slotOf[i] = s;
+	resetSlot(s);
+	return s;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::compactCollapsed() {
+	// 伝播し終えた時点で隣接セルはすべてこのタイルと両立しているので、以後の伝播では読む必要がない
+	for (const int32 i : m_collapsed) {
+		const int32 s = m_slotOf[i];
+		if (s < 0 || m_sumsOfOnes[i] != 1) {
+			continue;
+		}
+
+		const uint64* w = &m_wave[static_cast<size_t>(s) * m_waveWords];
+		for (int32 k = 0; k < m_waveWords; k++) {
+			if (w[k] != 0) {
+				m_observed[i] = k * 64 + std::countr_zero(w[k]);
+				break;
+			}
+		}
+
+		m_slotOf[i] = -1;
+		m_freeSlots << s;
+	}
+	m_collapsed.clear();
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::setListener(Listener* listener) {
+	m_listener = listener;
+	m_banLog.clear();
+
+	// 保存済みの初期状態には制約による除去の記録がないかもしれない
+	m_hasInitialState = false;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::setLargeGrid(bool enabled) {
+	m_largeGrid = enabled;
+	m_initialized = false;
+	m_hasInitialState = false;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::constrain(const Region& region, const Array<bool>& allowed) {
+	m_constraints << Constraint{ region, allowed };
+	m_hasInitialState = false;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::constrainTile(const Region& region, int32 t) {
+	Array<bool> allowed(m_T, false);
+	allowed[t] = true;
+	constrain(region, allowed);
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::clearConstraints() {
+	m_constraints.clear();
+	m_hasInitialState = false;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::clearContradictionCounts() {
+	m_contradictionCounts.fill(0);
+}
+
+template <class Topology>
+Image BasicWfcModel<Topology>::contradictionHeatmap() const requires std::same_as<Topology, Topology2D> {
+	Image image(m_gridSize);
+
+	const int32 maxCount = m_contradictionCounts.isEmpty() ? 0 : *std::max_element(m_contradictionCounts.begin(), m_contradictionCounts.end());
+
+	for (int32 y = 0; y < m_gridSize.y; y++) {
+		for (int32 x = 0; x < m_gridSize.x; x++) {
+			const int32 count = maxCount > 0 ? m_contradictionCounts[cellIndex({ x, y })] : 0;
+			const double v = maxCount > 0 ? static_cast<double>(count) / maxCount : 0.0;
+
+			image[y][x] = Color(
+				static_cast<uint8>(Min(v * 2.0, 1.0) * 255),
+				static_cast<uint8>(Max(v * 2.0 - 1.0, 0.0) * 255),
+				0
+			);
+		}
+	}
+
+	return image;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::recordContradiction(int32 i) {
+	if (m_contradiction >= 0) {
+		return;
+	}
+
+	m_contradiction = i;
+	if (not m_contradictionCounts.isEmpty()) {
+		m_contradictionCounts[i]++;
+	}
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::applyConstraint(const Region& region, const Array<bool>& allowed) {
+	uint64 allowedMask = 0;
+	for (int32 t = 0; t < m_T && t < WfcRuleSet::MaxSingleWordTiles; t++) {
+		if (allowed[t]) {
+			allowedMask |= uint64{ 1 } << t;
+		}
+	}
+
+	Topology::EachCell(m_gridSize, region, [&](int32 i) {
+		const int32 s = ensureSlot(i);
+
+		if (m_kernel == Kernel::SingleWord) {
+			restrictSingleWord(i, m_wave[s] & allowedMask);
+			return;
+		}
+
+		for (int32 t = 0; t < m_T; t++) {
+			if (isPossible(i, t) && not allowed[t]) {
+				ban(i, t);
+			}
+		}
+	});
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::saveInitialState() {
+	InitialState& state = m_initialState;
+
+	const size_t slots = m_slotCount;
+	const size_t words = m_waveWords;
+	const size_t compatibleSize = m_kernel == Kernel::Generic ? static_cast<size_t>(m_T) * Directions : 0;
+
+	state.wave.clear();
+	state.compatible.clear();
+	state.sumsOfWeights.clear();
+	state.sumsOfWeightLogWeights.clear();
+	state.entropies.clear();
+	state.slotTemplate.resize(slots);
+
+	const auto sameAs = [&](size_t s, size_t k) {
+		return std::equal(&m_wave[s * words], &m_wave[s * words] + words, &state.wave[k * words])
+			&& std::equal(&m_compatible[s * compatibleSize], &m_compatible[s * compatibleSize] + compatibleSize, &state.compatible[k * compatibleSize])
+			&& std::bit_cast<uint64>(m_sumsOfWeights[s]) == std::bit_cast<uint64>(state.sumsOfWeights[k])
+			&& std::bit_cast<uint64>(m_sumsOfWeightLogWeights[s]) == std::bit_cast<uint64>(state.sumsOfWeightLogWeights[k])
+			&& std::bit_cast<uint64>(m_entropies[s]) == std::bit_cast<uint64>(state.entropies[k]);
+	};
+
+	// 内容のハッシュ → 同じハッシュを持つ見本の番号
+	HashTable<uint64, Array<int32>> buckets;
+
+	for (size_t s = 0; s < slots; s++) {
+		Fnv1a fnv;
+		for (size_t k = 0; k < words; k++) {
+			fnv.mix(m_wave[s * words + k]);
+		}
+		for (size_t k = 0; k < compatibleSize; k++) {
+			fnv.mix(static_cast<uint16>(m_compatible[s * compatibleSize + k]));
+		}
+		fnv.mix(std::bit_cast<uint64>(m_sumsOfWeights[s]));
+
+		state.slotTemplate[s] = FindOrAddUnique(buckets, fnv.value, [&](int32 k) { return sameAs(s, k); }, [&] {
+			state.wave.insert(state.wave.end(), &m_wave[s * words], &m_wave[s * words] + words);
+			state.compatible.insert(state.compatible.end(), &m_compatible[s * compatibleSize], &m_compatible[s * compatibleSize] + compatibleSize);
+			state.sumsOfWeights << m_sumsOfWeights[s];
+			state.sumsOfWeightLogWeights << m_sumsOfWeightLogWeights[s];
+			state.entropies << m_entropies[s];
+
+			return static_cast<int32>(state.sumsOfWeights.size() - 1);
+		});
+	}
+
+	state.observed = m_observed;
+	state.sumsOfOnes = m_sumsOfOnes;
+	state.slotOf = m_slotOf;
+	state.freeSlots = m_freeSlots;
+	state.slotCount = m_slotCount;
+	state.frontier = m_frontier;
+	state.frontierIndex = m_frontierIndex;
+	state.bans = m_banLog;
+	state.contradiction = m_contradiction;
+	m_hasInitialState = true;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::restoreInitialState() {
+	const InitialState& state = m_initialState;
+
+	const size_t slots = state.slotCount;
+	const size_t compatibleSize = m_kernel == Kernel::Generic ? static_cast<size_t>(m_T) * Directions : 0;
+
+	m_wave.resize(slots * m_waveWords);
+	m_compatible.resize(slots * compatibleSize);
+	m_sumsOfWeights.resize(slots);
+	m_sumsOfWeightLogWeights.resize(slots);
+	m_entropies.resize(slots);
+
+	for (size_t s = 0; s < slots; s++) {
+		copySlotTemplate(static_cast<int32>(s), state.slotTemplate[s]);
+	}
+
+	m_observed = state.observed;
+	m_sumsOfOnes = state.sumsOfOnes;
+	m_slotOf = state.slotOf;
+	m_freeSlots = state.freeSlots;
+	m_slotCount = state.slotCount;
+	m_frontier = state.frontier;
+	m_frontierIndex = state.frontierIndex;
+	// 制約だけで矛盾していたなら、戻した状態も矛盾したままにする
+	m_contradiction = state.contradiction;
+	m_collapsed.clear();
+	m_observationStored = false;
+	m_observedSoFar = 0;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::copySlotTemplate(int32 s, int32 k) {
+	const InitialState& state = m_initialState;
+
+	const size_t words = m_waveWords;
+	const size_t compatibleSize = m_kernel == Kernel::Generic ? static_cast<size_t>(m_T) * Directions : 0;
+
+	std::copy_n(&state.wave[k * words], words, &m_wave[s * words]);
+	std::copy_n(state.compatible.begin() + k * compatibleSize, compatibleSize, m_compatible.begin() + s * compatibleSize);
+	m_sumsOfWeights[s] = state.sumsOfWeights[k];
+	m_sumsOfWeightLogWeights[s] = state.sumsOfWeightLogWeights[k];
+	m_entropies[s] = state.entropies[k];
+}
+
+template <class Topology>
+Blob BasicWfcModel<Topology>::encodeResult() const {
+	if (not m_observationStored) {
+		std::cout << "ERROR: the model has not completed" << std::endl;
+		return {};
+	}
+
+	Array<uint8> bytes;
+	Append(bytes, ResultMagic);
+	Append(bytes, ResultVersion);
+	Append(bytes, m_rules->hash);
+	Append(bytes, m_T);
+	Append(bytes, ExtentValues(m_gridSize));
+	Append(bytes, m_N);
+	Append(bytes, static_cast<uint8>(m_periodic));
+
+	ResultCoder<Topology> coder(*m_rules, m_gridSize);
+	RangeEncoder encoder;
+
+	const int32 cells = cellCount();
+	for (int32 i = 0; i < cells; i++) {
+		coder.encode(encoder, m_observed, i);
+	}
+
+	const Array<uint8> payload = encoder.finish();
+	bytes.insert(bytes.end(), payload.begin(), payload.end());
+
+	return Blob{ bytes.data(), bytes.size() };
+}
+
+template <class Topology>
+bool BasicWfcModel<Topology>::decodeResult(const Blob& blob) {
+	const uint8* p = reinterpret_cast<const uint8*>(blob.data());
+	const uint8* end = p + blob.size();
+
+	uint32 magic = 0;
+	uint16 version = 0;
+	uint64 hash = 0;
+	int32 T = 0;
+	std::array<int32, 3> extent{};
+	int32 N = 0;
+	uint8 periodic = 0;
+
+	if (not (Read(p, end, magic) && Read(p, end, version) && Read(p, end, hash) && Read(p, end, T)
+		&& Read(p, end, extent) && Read(p, end, N) && Read(p, end, periodic))
+		|| magic != ResultMagic || version != ResultVersion) {
+		std::cout << "ERROR: not a WFC result" << std::endl;
+		return false;
+	}
+
+	if (hash != m_rules->hash || T != m_T) {
+		std::cout << "ERROR: the result was generated with different rules" << std::endl;
+		return false;
+	}
+
+	if (extent != ExtentValues(m_gridSize) || N != m_N || (periodic != 0) != m_periodic) {
+		std::cout << "ERROR: the result was generated with a different grid" << std::endl;
+		return false;
+	}
+
+	ResultCoder<Topology> coder(*m_rules, m_gridSize);
+	RangeDecoder decoder(p, static_cast<size_t>(end - p));
+
+	const int32 cells = cellCount();
+	Array<int32> observed(cells, -1);
+
+	for (int32 i = 0; i < cells; i++) {
+		const int32 t = coder.decode(decoder, observed, i);
+		if (t < 0 || t >= m_T) {
+			std::cout << "ERROR: broken WFC result" << std::endl;
+			return false;
+		}
+		observed[i] = t;
+	}
+
+	if (decoder.overrun()) {
+		std::cout << "ERROR: broken WFC result" << std::endl;
+		return false;
+	}
+
+	if (not m_initialized) {
+		init();
+		if (not m_initialized) {
+			return false;
+		}
+	}
+	restoreObserved(observed);
+	return true;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::restoreObserved(const Array<int32>& observed) {
+	// 各セルの候補を結果のタイル1つにした完了状態にする。支持数は以後の伝播で使わないので戻さない
+	const int32 cells = cellCount();
+
+	m_stack.clear();
+	m_contradiction = -1;
+	m_collapsed.clear();
+	m_banLog.clear();
+	m_frontier.clear();
+	m_frontierIndex.fill(-1);
+
+	if (m_largeGrid) {
+		m_slotOf.fill(-1);
+		m_freeSlots.clear();
+		m_slotCount = 0;
+		m_wave.clear();
+		m_compatible.clear();
+		m_sumsOfWeights.clear();
+		m_sumsOfWeightLogWeights.clear();
+		m_entropies.clear();
+	}
+	else {
+		for (int32 i = 0; i < cells; i++) {
+			collapseCell(i, observed[i]);
+		}
+	}
+
+	m_observed = observed;
+	m_sumsOfOnes.fill(1);
+	m_observedSoFar = cells;
+	m_observationStored = true;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::collapseCell(int32 i, int32 t) {
+	// 大規模モードでは領域を回収し、タイル番号だけを残す
+	if (m_largeGrid) {
+		if (m_slotOf[i] >= 0) {
+			m_freeSlots << m_slotOf[i];
+			m_slotOf[i] = -1;
+		}
+	}
+	else {
+		uint64* w = &m_wave[static_cast<size_t>(i) * m_waveWords];
+		std::fill_n(w, m_waveWords, 0);
+		w[t >> 6] = uint64{ 1 } << (t & 63);
+		m_sumsOfWeights[i] = m_rules->weights[t];
+		m_sumsOfWeightLogWeights[i] = m_rules->weightLogWeights[t];
+		m_entropies[i] = 0;
+	}
+
+	m_observed[i] = t;
+	m_sumsOfOnes[i] = 1;
+}
+
+template <class Topology>
+bool BasicWfcModel<Topology>::run(int32 seed, int32 limit) {
+	if (not m_initialized) {
+		init();
+		if (not m_initialized) {
+			return false;
+		}
+	}
+
+	clear();
+	Reseed(seed);
+
+	if (not m_constraintsSatisfiable) {
+		return false;
+	}
+
+	for (auto l = 0; l < limit || limit < 0; l++) {
+		auto node = nextUnobservedNode();
+		if (node >= 0) {
+			observe(node);
+			bool success = propagate();
+			notifyPropagated(success);
+			if (!success) {
+				return false;
+			}
+		}
+		else {
+			storeObserved();
+			return true;
+		}
+	}
+
+	return true;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::runOneStep() {
+
+	if (not m_initialized) {
+		init();
+		if (not m_initialized) {
+			return;
+		}
+		clear();
+	}
+
+	if (m_contradiction >= 0) {
+		return;
+	}
+
+	const auto node = nextUnobservedNode();
+	if (node >= 0) {
+		observe(node);
+		bool success = propagate();
+		notifyPropagated(success);
+		if (!success) {
+			return;
+		}
+	}
+	else {
+		storeObserved();
+		return;
+	}
+}
+
+template <class Topology>
+bool BasicWfcModel<Topology>::regenerate(const Region& region, int32 seed) {
+	Array<int32> cells;
+	Topology::EachCell(m_gridSize, region, [&](int32 i) {
+		cells << i;
+	});
+	return regenerate(cells, seed);
+}
+
+template <class Topology>
+bool BasicWfcModel<Topology>::regenerate(const Array<int32>& cells, int32 seed) {
+	if (not m_observationStored) {
+		std::cout << "ERROR: the model has not completed" << std::endl;
+		return false;
+	}
+
+	// 領域の初期候補には制約を適用した直後の状態を使う。途中経過はリスナーに見せない
+	if (not m_hasInitialState) {
+		Listener silent;
+		Listener* listener = m_listener ? std::exchange(m_listener, &silent) : nullptr;
+
+		const Array<int32> observed = m_observed;
+		clear();
+		restoreObserved(observed);
+
+		if (listener) {
+			m_listener = listener;
+		}
+	}
+
+	const InitialState& state = m_initialState;
+	const int32 total = cellCount();
+
+	// 大規模モードで制約により初めから確定して回収されているセルは、作り直さずに固定のまま残す
+	m_region.clear();
+	for (const int32 i : cells) {
+		if (i < 0 || i >= total || (m_largeGrid && state.slotOf[i] < 0 && state.observed[i] >= 0)) {
+			continue;
+		}
+		m_region << i;
+	}
+	std::sort(m_region.begin(), m_region.end());
+	m_region.erase(std::unique(m_region.begin(), m_region.end()), m_region.end());
+
+	if (m_region.isEmpty()) {
+		return true;
+	}
+
+	Array<int32> previous(m_region.size());
+	for (size_t k = 0; k < m_region.size(); k++) {
+		previous[k] = m_observed[m_region[k]];
+	}
+
+	Reseed(seed);
+
+	m_stack.clear();
+	m_contradiction = -1;
+	m_collapsed.clear();
+	m_banLog.clear();
+	m_observationStored = false;
+	m_observedSoFar = 0;
+
+	for (const int32 i : m_region) {
+		if (m_largeGrid) {
+			if (m_slotOf[i] >= 0) {
+				m_freeSlots << m_slotOf[i];
+				m_slotOf[i] = -1;
+			}
+			// 初期状態で領域のなかったセルは全タイルが候補なので、スロットは必要になるまで割り当てない
+			if (state.slotOf[i] >= 0) {
+				copySlotTemplate(ensureSlot(i), state.slotTemplate[state.slotOf[i]]);
+			}
+		}
+		else {
+			copySlotTemplate(i, state.slotTemplate[i]);
+		}
+
+		m_sumsOfOnes[i] = state.sumsOfOnes[i];
+		m_observed[i] = -1;
+	}
+
+	if (m_listener) {
+		m_listener->onRegionReset(m_region);
+	}
+
+	const WfcRuleSet& rules = *m_rules;
+	std::array<int32, Directions> buffer;
+
+	// 領域に接する確定したセルは、領域の側の支持数だけを初期候補から数え直す。それ以外の方向は以後も減らない
+	Array<int32> boundary;
+	for (const int32 i : m_region) {
+		const int32* neighbors = neighborsOf(i, buffer);
+
+		for (int32 d = 0; d < Directions; d++) {
+			const int32 j = neighbors[d];
+			if (j < 0 || isInRegion(j) || isCompacted(j)) {
+				continue;
+			}
+			boundary << j;
+
+			if (m_kernel == Kernel::SingleWord) {
+				continue;
+			}
+
+			int16* compat = &m_compatible[static_cast<size_t>(slotOf(j)) * m_T * Directions];
+			for (int32 t = 0; t < m_T; t++) {
+				compat[t * Directions + d] = 0;
+			}
 
-	for (int32 t = 0; t < m_T; t++) {
-		m_weightLogWeights[t] = m_weights[t] * Math::Log(m_weights[t]);
-		m_sumOfWeights += m_weights[t];
-		m_sumOfWeightLogWeights += m_weightLogWeights[t];
+			int16 count = 0;
+			rules.eachCompatible(Topology::Opposite[d], m_observed[j], [&](int32 t) {
+				if (isPossible(i, t)) {
+					count++;
+				}
+			});
+			compat[m_observed[j] * Directions + d] = count;
+		}
 	}
 
-	m_startingEntropy = Math::Log(m_sumOfWeights) - m_sumOfWeightLogWeights / m_sumOfWeights;
+	// 領域のセルの候補を、外側の確定したセルのタイルと両立するものに絞る
+	for (const int32 i : m_region) {
+		const int32* neighbors = neighborsOf(i, buffer);
 
-	m_stack.resize(m_wave.num_elements() * m_T, std::make_pair<Point, int32>({ 0,0 }, 0));
-	m_stacksize = 0;
-}
+		for (int32 d = 0; d < Directions; d++) {
+			const int32 j = neighbors[d];
+			if (j < 0 || isInRegion(j)) {
+				continue;
+			}
+
+			const int32 from = Topology::Opposite[d];
+			const int32 s = ensureSlot(i);
+
+			if (m_kernel == Kernel::SingleWord) {
+				restrictSingleWord(i, m_wave[s] & supportedMask(from, uint64{ 1 } << m_observed[j]));
+				continue;
+			}
+
+			int16* compat = &m_compatible[static_cast<size_t>(s) * m_T * Directions];
+			for (int32 t = 0; t < m_T; t++) {
+				compat[t * Directions + from] = 0;
+			}
+			rules.eachCompatible(from, m_observed[j], [&](int32 t) {
+				if (isPossible(i, t)) {
+					compat[t * Directions + from] = 1;
+				}
+			});
 
-void WfcModel::clear() {
-	for (auto y : step(m_wave.height())) {
-		for (auto x : step(m_wave.width())) {
 			for (int32 t = 0; t < m_T; t++) {
-				m_wave[y][x][t] = true;
-				for (int32 d = 0; d < 4; d++) {
-					m_compatible[y][x][t][d] = m_propagator[opposite[d]][t].size();
+				if (isPossible(i, t) && compat[t * Directions + from] == 0) {
+					ban(i, t);
 				}
 			}
+		}
+	}
+
+	bool success = propagate();
+	notifyPropagated(success);
 
-			m_sumsOfOnes[y][x] = m_weights.size();
-			m_sumsOfWeights[y][x] = m_sumOfWeights;
-			m_sumsOfWeightLogWeights[y][x] = m_sumOfWeightLogWeights;
-			m_entropies[y][x] = m_startingEntropy;
-			m_observed[y][x] = -1;
+	while (success) {
+		const int32 node = nextUnobservedNode();
+		if (node < 0) {
+			break;
 		}
+
+		observe(node);
+		success = propagate();
+		notifyPropagated(success);
 	}
-	m_observedSoFar = 0;
 
-	if (m_ground) {
-		for (int32 x = 0; x < m_gridSize.x; x++) {
-			for (int32 t = 0; t < m_T - 1; t++) {
-				ban({ x , m_gridSize.y - 1 }, t);
-			}
-			for (int32 y = 0; y < m_gridSize.y - 1; y++) {
-				ban({ x , y }, m_T - 1);
-			}
+	if (success) {
+		storeObserved();
+	}
+	else {
+		// 元の結果に戻す。矛盾の伝播で外側の確定したセルが削られていることもある
+		for (size_t k = 0; k < m_region.size(); k++) {
+			collapseCell(m_region[k], previous[k]);
+		}
+		for (const int32 j : boundary) {
+			collapseCell(j, m_observed[j]);
 		}
-		propagate();
+		m_stack.clear();
+		m_observationStored = true;
 	}
+
+	m_region.clear();
+	return success;
 }
 
-bool WfcModel::run(int32 seed, int32 limit) {
-	if (m_wave.empty()) {
-		init();
+template <class Topology>
+void BasicWfcModel<Topology>::setPropagationThreads(int32 threads, int32 threshold) {
+	if (threads <= 1) {
+		m_parallel.reset();
+		return;
 	}
 
-	clear();
-	Reseed(seed);
+	m_parallel = std::make_unique<ParallelPropagation>(threads);
+	m_parallel->threshold = Max(threshold, 1);
+}
 
-	for (auto l = 0; l < limit || limit < 0; l++) {
-		auto node = nextUnm_observedNode();
-		if (node.x >= 0) {
-			observe(node);
-			bool success = propagate();
-			if (!success) {
-				return false;
+template <class Topology>
+bool BasicWfcModel<Topology>::hasCompleted() const {
+	return m_initialized && m_sumsOfOnes.sum() == m_sumsOfOnes.size();
+}
+
+template <class Topology>
+typename BasicWfcModel<Topology>::MemoryFootprint BasicWfcModel<Topology>::memoryFootprint() const {
+	MemoryFootprint result;
+
+	result.wave = m_wave.capacity() * sizeof(uint64);
+
+	result.compatible = (m_compatible.capacity() + m_initialCompatible.capacity()) * sizeof(int16);
+
+	// 規則側の表は共有されるが、このモデルが参照している分として数える
+	result.propagator = m_rules->propagatorBytes();
+
+	result.stack = m_stack.capacity() * sizeof(uint64);
+	if (m_parallel) {
+		for (const auto& list : m_parallel->banned) {
+			result.stack += list.capacity() * sizeof(uint64);
+		}
+	}
+
+	result.cellStatistics = m_observed.capacity() * sizeof(int32)
+		+ m_sumsOfOnes.capacity() * sizeof(int32)
+		+ m_sumsOfWeights.capacity() * sizeof(double)
+		+ m_sumsOfWeightLogWeights.capacity() * sizeof(double)
+		+ m_entropies.capacity() * sizeof(double)
+		+ (m_slotOf.capacity() + m_freeSlots.capacity() + m_collapsed.capacity()) * sizeof(int32)
+		+ (m_frontier.capacity() + m_frontierIndex.capacity()) * sizeof(int32)
+		+ (m_contradictionCounts.capacity() + m_region.capacity()) * sizeof(int32)
+		+ m_banLog.capacity() * sizeof(Ban);
+
+	result.tileTables = (m_rules->weights.capacity() + m_distribution.capacity() + m_rules->weightLogWeights.capacity()) * sizeof(double);
+
+	result.neighbors = m_neighbors.capacity() * sizeof(int32);
+
+	const InitialState& state = m_initialState;
+	result.initialState = state.wave.capacity() * sizeof(uint64)
+		+ state.compatible.capacity() * sizeof(int16)
+		+ (state.sumsOfWeights.capacity() + state.sumsOfWeightLogWeights.capacity() + state.entropies.capacity()) * sizeof(double)
+		+ (state.slotTemplate.capacity() + state.observed.capacity() + state.sumsOfOnes.capacity() + state.slotOf.capacity()
+			+ state.freeSlots.capacity() + state.frontier.capacity() + state.frontierIndex.capacity()) * sizeof(int32)
+		+ state.bans.capacity() * sizeof(Ban);
+
+	return result;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::storeObserved() {
+	const int32 cells = activeCellCount();
+
+	for (int32 k = 0; k < cells; k++) {
+		const int32 i = activeCell(k);
+		const int32 s = slotOf(i);
+		if (s < 0) {
+			// 一度も絞られなかったノード以外のセルは、通常モードと同じく最小の番号にしておく
+			if (m_observed[i] < 0) {
+				m_observed[i] = 0;
 			}
+			continue;
 		}
-		else {
-			for (auto y : step(m_wave.height())) {
-				for (auto x : step(m_wave.width())) {
-					for (int32 t = 0; t < m_T; t++) {
-						if (m_wave[y][x][t]) {
-							m_observed[y][x] = t;
-							break;
-						}
-					}
-				}
+
+		const uint64* w = &m_wave[static_cast<size_t>(s) * m_waveWords];
+
+		for (int32 k = 0; k < m_waveWords; k++) {
+			if (w[k] != 0) {
+				m_observed[i] = k * 64 + std::countr_zero(w[k]);
+				break;
 			}
-			return true;
 		}
 	}
 
-	return true;
+	m_observationStored = true;
+
+	if (m_listener) {
+		m_listener->onCompleted();
+	}
 }
 
-void WfcModel::runOneStep() {
+template <class Topology>
+int32 BasicWfcModel<Topology>::nextUnobservedNode() {
+	const int32 cells = activeCellCount();
 
-	if (m_wave.empty()) {
-		init();
-		clear();
+	if (m_heuristic == Heuristic::Scanline) {
+		for (int32 k = m_observedSoFar; k < cells; k++) {
+			const int32 i = activeCell(k);
+			if (!Topology::IsNode(m_gridSize, m_N, m_periodic, Topology::Coordinates(m_gridSize, i)))
+				continue;
+
+			if (m_sumsOfOnes[i] > 1) {
+				m_observedSoFar = k + 1;
+				return i;
+			}
+		}
+		return -1;
 	}
 
-	const auto node = nextUnm_observedNode();
-	if (node.x >= 0) {
-		observe(node);
-		bool success = propagate();
-		if (!success) {
-			return;
+	if (m_heuristic == Heuristic::Frontier) {
+		const int32 node = nextFrontierNode();
+		if (node >= 0) {
+			return node;
 		}
+		// 前線が空なら全体から選び、そこを新しい起点にする
 	}
-	else {
-		for (auto y : step(m_wave.height())) {
-			for (auto x : step(m_wave.width())) {
-				for (int32 t = 0; t < m_T; t++) {
-					if (m_wave[y][x][t] == true) {
-						m_observed[y][x] = t;
-						break;
-					}
-				}
+
+	double min = 1E+4;
+	int32 argmin = -1;
+	for (int32 k = 0; k < cells; k++) {
+		const int32 i = activeCell(k);
+		if (!Topology::IsNode(m_gridSize, m_N, m_periodic, Topology::Coordinates(m_gridSize, i)))
+			continue;
+
+		int32 remainingValues = m_sumsOfOnes[i];
+		if (remainingValues <= 1)
+			continue;
+
+		const int32 s = slotOf(i);
+		double entropy = m_heuristic == Heuristic::MRV ? remainingValues : s >= 0 ? m_entropies[s] : m_rules->startingEntropy;
+
+		if (remainingValues > 1 && entropy <= min) {
+			double noise = 1E-6 * Random<double>(0, 1.0);
+			if (entropy + noise < min) {
+				min = entropy + noise;
+				argmin = i;
+			}
+		}
+	}
+	return argmin;
+}
+
+template <class Topology>
+int32 BasicWfcModel<Topology>::nextFrontierNode() {
+	// m_frontier の並びは伝播の順(並列なら整列後の順)と外し方で変わるので、選び方をそれに左右されないようにする
+	// 乱数は1回だけ引いてセルごとの揺らぎをそこから決め、同じ値ならセル番号の小さい方を選ぶ
+	const uint64 salt = std::bit_cast<uint64>(Random<double>(0, 1.0));
+
+	double min = 1E+4;
+	int32 argmin = -1;
+
+	for (size_t k = 0; k < m_frontier.size();) {
+		const int32 i = m_frontier[k];
+
+		if (m_sumsOfOnes[i] <= 1 || !Topology::IsNode(m_gridSize, m_N, m_periodic, Topology::Coordinates(m_gridSize, i))) {
+			// 末尾と入れ替えて外す
+			m_frontierIndex[m_frontier.back()] = static_cast<int32>(k);
+			m_frontier[k] = m_frontier.back();
+			m_frontier.pop_back();
+			m_frontierIndex[i] = -1;
+			continue;
+		}
+
+		const int32 s = slotOf(i);
+		const double entropy = s >= 0 ? m_entropies[s] : m_rules->startingEntropy;
+
+		if (entropy <= min) {
+			const double noise = 1E-6 * CellNoise(salt, i);
+			if (entropy + noise < min || (entropy + noise == min && i < argmin)) {
+				min = entropy + noise;
+				argmin = i;
+			}
+		}
+		++k;
+	}
+
+	return argmin;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::observe(int32 node) {
+	if (m_heuristic == Heuristic::Frontier) {
+		std::array<int32, Directions> buffer;
+		const int32* neighbors = neighborsOf(node, buffer);
+		for (int32 d = 0; d < Directions; ++d) {
+			const int32 i = neighbors[d];
+			if (i >= 0) {
+				enterFrontier(i);
 			}
 		}
+	}
+
+	if (m_kernel == Kernel::SingleWord) {
+		observeSingleWord(node);
 		return;
 	}
+
+	const Array<double>& weights = m_rules->weights;
+	ensureSlot(node);
+
+	for (auto t = 0; t < m_T; ++t)
+		m_distribution[t] = isPossible(node, t) ? weights[t] : 0.0;
+
+	auto r = RandomHelper::Random(m_distribution, Random<double>(0, 1.0));
+
+	if (m_listener) {
+		m_listener->onObserved(node, r);
+	}
+
+	for (auto t = 0; t < m_T; ++t) {
+		if (isPossible(node, t) != (t == r)) {
+			ban(node, t);
+		}
+	}
 }
 
-bool WfcModel::hasCompleted() const {
-	return not m_wave.isEmpty() && m_sumsOfOnes.asArray().sum() == m_sumsOfOnes.num_elements();
+template <class Topology>
+bool BasicWfcModel<Topology>::propagate() {
+	const bool success = m_kernel == Kernel::SingleWord ? propagateSingleWord() : propagateGeneric();
+
+	if (m_largeGrid) {
+		if (success) {
+			compactCollapsed();
+		}
+		else {
+			m_collapsed.clear();
+		}
+	}
+
+	return success;
 }
 
-Point WfcModel::nextUnm_observedNode() {
-	if (m_heuristic == Heuristic::Scanline) {
-		for (auto y : step(m_wave.height())) {
-			for (auto x : step(m_wave.width())) {
+template <class Topology>
+void BasicWfcModel<Topology>::notifyPropagated(bool success) {
+	if (not m_listener) {
+		return;
+	}
 
-				if (!m_periodic && (y % m_gridSize.x + m_N > m_gridSize.x || y / m_gridSize.x + m_N > m_gridSize.y))
-					continue;
+	if (not m_banLog.isEmpty()) {
+		m_listener->onBanned(m_banLog);
+		m_banLog.clear();
+	}
+
+	if (not success && m_contradiction >= 0) {
+		m_listener->onContradiction(m_contradiction);
+	}
+}
+
+template <class Topology>
+bool BasicWfcModel<Topology>::propagateGeneric() {
+	const WfcRuleSet& rules = *m_rules;
+	std::array<int32, Directions> buffer;
+
+	if (m_contradiction >= 0) {
+		m_stack.clear();
+		return false;
+	}
+
+	while (not m_stack.isEmpty()) {
+		if (m_parallel && not m_largeGrid && m_stack.size() >= static_cast<size_t>(m_parallel->threshold)) {
+			return propagateParallel();
+		}
+
+		const uint64 current = m_stack.back();
+		m_stack.pop_back();
+
+		const int32 i1 = static_cast<int32>(current >> 32);
+		const int32 t1 = static_cast<int32>(current & 0xFFFFFFFF);
+		const int32* neighbors = neighborsOf(i1, buffer);
+
+		for (auto d = 0; d < Directions; ++d) {
+			const int32 i2 = neighbors[d];
+			if (i2 < 0 || isCompacted(i2))
+				continue;
+
+			int16* compat = &m_compatible[static_cast<size_t>(ensureSlot(i2)) * m_T * Directions];
 
-				if (m_sumsOfOnes[y][x] > 1) {
-					m_observedSoFar = y + 1;
-					return { x , y };;
+			rules.eachCompatible(d, t1, [&](int32 t2) {
+				int16& comp = compat[t2 * Directions + d];
+
+				comp--;
+				if (comp == 0) {
+					ban(i2, t2);
 				}
+			});
+
+			// 一覧の途中で候補が0になっても、残りは支持数を減らすだけなので一覧の最後で打ち切る
+			if (m_contradiction >= 0) {
+				m_stack.clear();
+				return false;
 			}
 		}
-		return { -1, -1 };
 	}
 
-	double min = 1E+4;
-	Point argmin{ -1, -1 };
-	for (auto y : step(m_wave.height())) {
-		for (auto x : step(m_wave.width())) {
-			if (!m_periodic && (x % m_gridSize.x + m_N > m_gridSize.x || x / m_gridSize.x + m_N > m_gridSize.y))
+	return true;
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::ban(int32 i, int32 t) {
+	const int32 s = slotOf(i);
+
+	m_wave[static_cast<size_t>(s) * m_waveWords + (t >> 6)] &= ~(uint64{ 1 } << (t & 63));
+
+	int16* comp = &m_compatible[(static_cast<size_t>(s) * m_T + t) * Directions];
+	for (int32 d = 0; d < Directions; ++d) {
+		comp[d] = 0;
+	}
+
+	m_stack << PackStackEntry(i, t);
+
+	if (m_listener) {
+		m_banLog << Ban{ i, t };
+	}
+
+	if (m_heuristic == Heuristic::Frontier) {
+		enterFrontier(i);
+	}
+
+	m_sumsOfOnes[i] -= 1;
+	m_sumsOfWeights[s] -= m_rules->weights[t];
+	m_sumsOfWeightLogWeights[s] -= m_rules->weightLogWeights[t];
+
+	double sum = m_sumsOfWeights[s];
+	m_entropies[s] = Math::Log(sum) - m_sumsOfWeightLogWeights[s] / sum;
+
+	if (m_sumsOfOnes[i] == 0) {
+		recordContradiction(i);
+	}
+	else if (m_largeGrid && m_sumsOfOnes[i] == 1) {
+		m_collapsed << i;
+	}
+}
+
+template <class Topology>
+void BasicWfcModel<Topology>::observeSingleWord(int32 node) {
+	const uint64 w = m_wave[ensureSlot(node)];
+	const Array<double>& weights = m_rules->weights;
+
+	for (auto t = 0; t < m_T; ++t)
+		m_distribution[t] = ((w >> t) & 1) ? weights[t] : 0.0;
+
+	auto r = RandomHelper::Random(m_distribution, Random<double>(0, 1.0));
+
+	if (m_listener) {
+		m_listener->onObserved(node, r);
+	}
+
+	restrictSingleWord(node, uint64{ 1 } << r);
+}
+
+template <class Topology>
+bool BasicWfcModel<Topology>::propagateSingleWord() {
+	if (m_contradiction >= 0) {
+		m_stack.clear();
+		return false;
+	}
+
+	std::array<int32, Directions> buffer;
+
+	// 候補が減ったセルを積み、隣接セルの候補を許されるタイル集合との積で絞り込む
+	while (not m_stack.isEmpty()) {
+		if (m_parallel && not m_largeGrid && m_stack.size() >= static_cast<size_t>(m_parallel->threshold)) {
+			return propagateParallel();
+		}
+
+		const int32 i1 = static_cast<int32>(m_stack.back() >> 32);
+		m_stack.pop_back();
+
+		const int32* neighbors = neighborsOf(i1, buffer);
+		const uint64 w1 = m_wave[slotOf(i1)];
+
+		for (auto d = 0; d < Directions; ++d) {
+			const int32 i2 = neighbors[d];
+			if (i2 < 0 || isCompacted(i2))
 				continue;
 
-			int32 remainingValues = m_sumsOfOnes[y][x];
-			double entropy = m_heuristic == Heuristic::Entropy ? m_entropies[y][x] : remainingValues;
+			const int32 s2 = slotOf(i2);
+			const uint64 w2 = s2 >= 0 ? m_wave[s2] : fullSingleWord();
+			const uint64 restricted = w2 & supportedMask(d, w1);
+
+			if (restricted != w2) {
+				restrictSingleWord(i2, restricted);
 
-			if (remainingValues > 1 && entropy <= min) {
-				double noise = 1E-6 * Random<double>(0, 1.0);
-				if (entropy + noise < min) {
-					min = entropy + noise;
-					argmin = { x , y };
+				if (m_contradiction >= 0) {
+					m_stack.clear();
+					return false;
 				}
 			}
 		}
 	}
-	return argmin;
+
+	return true;
 }
 
-void WfcModel::observe(const Point& node) {
-	const Array<bool>& w = m_wave[node.y][node.x];
+template <class Topology>
+void BasicWfcModel<Topology>::restrictSingleWord(int32 i, uint64 mask) {
+	const int32 s = ensureSlot(i);
 
-	for (auto t = 0; t < m_T; ++t)
-		m_distribution[t] = w[t] ? m_weights[t] : 0.0;
+	uint64 removed = m_wave[s] & ~mask;
+	if (removed == 0) {
+		return;
+	}
 
-	auto r = RandomHelper::Random(m_distribution, Random<double>(0, 1.0));
+	m_wave[s] &= mask;
 
-	for (auto t = 0; t < m_T; ++t) {
-		if (w[t] != (t == r)) {
-			ban(node, t);
+	const Array<double>& weights = m_rules->weights;
+	const Array<double>& weightLogWeights = m_rules->weightLogWeights;
+
+	for (; removed != 0; removed &= removed - 1) {
+		const int32 t = std::countr_zero(removed);
+		m_sumsOfWeights[s] -= weights[t];
+		m_sumsOfWeightLogWeights[s] -= weightLogWeights[t];
+
+		if (m_listener) {
+			m_banLog << Ban{ i, t };
+		}
+	}
+
+	m_stack << PackStackEntry(i, 0);
+
+	if (m_heuristic == Heuristic::Frontier) {
+		enterFrontier(i);
+	}
+
+	m_sumsOfOnes[i] = std::popcount(m_wave[s]);
+
+	double sum = m_sumsOfWeights[s];
+	m_entropies[s] = Math::Log(sum) - m_sumsOfWeightLogWeights[s] / sum;
+
+	if (m_wave[s] == 0) {
+		recordContradiction(i);
+	}
+	else if (m_largeGrid && m_sumsOfOnes[i] == 1) {
+		m_collapsed << i;
+	}
+}
+
+template <class Topology>
+uint64 BasicWfcModel<Topology>::supportedMask(int32 d, uint64 mask) const {
+	const int32 chunks = m_rules->supportChunks;
+	const uint64* table = &m_rules->supportTables[d * chunks * 256];
+
+	uint64 result = 0;
+	for (int32 k = 0; k < chunks; ++k, mask >>= 8) {
+		result |= table[k * 256 + (mask & 0xFF)];
+	}
+	return result;
+}
+
+template <class Topology>
+bool BasicWfcModel<Topology>::propagateParallel() {
+	ParallelPropagation& parallel = *m_parallel;
+	const int32 threads = parallel.team.size();
+
+	// ワーカーが動く前なので、呼び出し元が各スレッドの列に配ってよい
+	for (size_t k = 0; k < m_stack.size(); ++k) {
+		parallel.queues[k % threads]->push(m_stack[k]);
+	}
+	parallel.pending.store(static_cast<int64>(m_stack.size()));
+	parallel.contradiction.store(-1);
+	m_stack.clear();
+
+	parallel.team.run([&](int32 worker) {
+		WorkStealingDeque& own = *parallel.queues[worker];
+		uint64 item;
+
+		while (parallel.contradiction.load(std::memory_order_relaxed) < 0) {
+			bool found = own.pop(item);
+			for (int32 k = 1; not found && k < threads; ++k) {
+				found = parallel.queues[(worker + k) % threads]->steal(item);
+			}
+
+			if (found) {
+				propagateParallelItem(worker, item);
+				parallel.pending.fetch_sub(1, std::memory_order_acq_rel);
+			}
+			else if (parallel.pending.load(std::memory_order_acquire) == 0) {
+				break;
+			}
+			else {
+				std::this_thread::yield();
+			}
+		}
+	});
+
+	for (auto& queue : parallel.queues) {
+		queue->reset();
+	}
+
+	// 除去の順序はスレッドの進み方で変わるので、並べ替えてから重みの和とエントロピーを更新する
+	// (セル, タイル)の順に引くので、並列どうしでは再現するが逐次の除去の順とは一致しない
+	Array<uint64> banned;
+	for (auto& list : parallel.banned) {
+		banned.insert(banned.end(), list.begin(), list.end());
+		list.clear();
+	}
+	std::sort(banned.begin(), banned.end());
+
+	const Array<double>& weights = m_rules->weights;
+	const Array<double>& weightLogWeights = m_rules->weightLogWeights;
+
+	for (size_t k = 0; k < banned.size(); ++k) {
+		const int32 i = static_cast<int32>(banned[k] >> 32);
+		const int32 t = static_cast<int32>(banned[k] & 0xFFFFFFFF);
+
+		m_sumsOfWeights[i] -= weights[t];
+		m_sumsOfWeightLogWeights[i] -= weightLogWeights[t];
+
+		if (m_listener) {
+			m_banLog << Ban{ i, t };
+		}
+
+		if (k + 1 < banned.size() && static_cast<int32>(banned[k + 1] >> 32) == i) {
+			continue;
+		}
+
+		if (m_kernel == Kernel::SingleWord) {
+			m_sumsOfOnes[i] = std::popcount(m_wave[i]);
+		}
+
+		if (m_heuristic == Heuristic::Frontier) {
+			enterFrontier(i);
 		}
+
+		double sum = m_sumsOfWeights[i];
+		m_entropies[i] = Math::Log(sum) - m_sumsOfWeightLogWeights[i] / sum;
+	}
+
+	const int32 contradiction = parallel.contradiction.load();
+	if (contradiction >= 0) {
+		recordContradiction(contradiction);
+		return false;
 	}
+
+	return true;
 }
 
-bool WfcModel::propagate() {
-	while (m_stacksize > 0) {
-		auto current = m_stack[m_stacksize - 1];
-		--m_stacksize;
+template <class Topology>
+void BasicWfcModel<Topology>::propagateParallelItem(int32 worker, uint64 item) {
+	ParallelPropagation& parallel = *m_parallel;
 
-		auto xy1 = current.first;
-		int32 t1 = current.second;
+	// 並列伝播は大規模モードでは使わないので、隣の表は必ずある
+	const int32 i1 = static_cast<int32>(item >> 32);
+	const int32* neighbors = &m_neighbors[static_cast<size_t>(i1) * Directions];
 
-		for (auto d = 0; d < 4; ++d) {
-			auto xy2 = xy1 + dxy[d];
+	if (m_kernel == Kernel::SingleWord) {
+		const uint64 w1 = std::atomic_ref<uint64>{ m_wave[i1] }.load(std::memory_order_acquire);
 
-			if (!m_periodic && (xy2.x < 0 || xy2.y < 0 || xy2.x + m_N > m_gridSize.x || xy2.y + m_N > m_gridSize.y))
+		for (auto d = 0; d < Directions; ++d) {
+			const int32 i2 = neighbors[d];
+			if (i2 < 0)
 				continue;
 
-			if (xy2.x < 0)
-				xy2.x += m_gridSize.x;
-			else if (xy2.x >= m_gridSize.x)
-				xy2.x -= m_gridSize.x;
+			const uint64 mask = supportedMask(d, w1);
+			std::atomic_ref<uint64> w2{ m_wave[i2] };
 
-			if (xy2.y < 0)
-				xy2.y += m_gridSize.y;
-			else if (xy2.y >= m_gridSize.y)
-				xy2.y -= m_gridSize.y;
+			if ((w2.load(std::memory_order_relaxed) & ~mask) == 0)
+				continue;
 
-			Array<int32>& p = m_propagator[d][t1];
-			Array<Array<int32>>& compat = m_compatible[xy2];
+			// ビットを落とせたスレッドがそのタイルの除去を受け持つ
+			const uint64 old = w2.fetch_and(mask, std::memory_order_acq_rel);
+			uint64 removed = old & ~mask;
+			if (removed == 0)
+				continue;
 
-			for (auto l = 0; l < p.size(); l++) {
-				int32 t2 = p[l];
-				Array<int32>& comp = compat[t2];
+			for (; removed != 0; removed &= removed - 1) {
+				parallel.banned[worker] << PackStackEntry(i2, std::countr_zero(removed));
+			}
 
-				comp[d]--;
-				if (comp[d] == 0) {
-					ban(xy2, t2);
-				}
+			if ((old & mask) == 0) {
+				int32 expected = -1;
+				parallel.contradiction.compare_exchange_strong(expected, i2);
 			}
+
+			parallel.pending.fetch_add(1, std::memory_order_relaxed);
+			parallel.queues[worker]->push(PackStackEntry(i2, 0));
 		}
+		return;
 	}
 
-	return m_sumsOfOnes[0][0] > 0;
+	const int32 t1 = static_cast<int32>(item & 0xFFFFFFFF);
+	const WfcRuleSet& rules = *m_rules;
+
+	for (auto d = 0; d < Directions; ++d) {
+		const int32 i2 = neighbors[d];
+		if (i2 < 0)
+			continue;
+
+		int16* compat = &m_compatible[static_cast<size_t>(i2) * m_T * Directions];
+
+		rules.eachCompatible(d, t1, [&](int32 t2) {
+			if (std::atomic_ref<int16>{ compat[t2 * Directions + d] }.fetch_sub(1, std::memory_order_relaxed) == 1) {
+				banParallel(worker, i2, t2);
+			}
+		});
+	}
 }
 
-void WfcModel::ban(const Point& p, int32 t) {
-	m_wave[p][t] = false;
+template <class Topology>
+void BasicWfcModel<Topology>::banParallel(int32 worker, int32 i, int32 t) {
+	ParallelPropagation& parallel = *m_parallel;
 
-	Array<int32>& comp = m_compatible[p][t];
-	for (int32 d = 0; d < 4; ++d) {
-		comp[d] = 0;
+	const uint64 bit = uint64{ 1 } << (t & 63);
+	std::atomic_ref<uint64> word{ m_wave[static_cast<size_t>(i) * m_waveWords + (t >> 6)] };
+
+	// 支持数は複数の方向で同時に0になりうる。ビットを落とせた1スレッドだけが先へ進む
+	if ((word.fetch_and(~bit, std::memory_order_acq_rel) & bit) == 0) {
+		return;
 	}
 
-	m_stack[m_stacksize++] = std::make_pair(p, t);
+	int16* comp = &m_compatible[(static_cast<size_t>(i) * m_T + t) * Directions];
+	for (int32 d = 0; d < Directions; ++d) {
+		std::atomic_ref<int16>{ comp[d] }.store(0, std::memory_order_relaxed);
+	}
+
+	parallel.banned[worker] << PackStackEntry(i, t);
 
-	m_sumsOfOnes[p] -= 1;
-	m_sumsOfWeights[p] -= m_weights[t];
-	m_sumsOfWeightLogWeights[p] -= m_weightLogWeights[t];
+	if (std::atomic_ref<int32>{ m_sumsOfOnes[i] }.fetch_sub(1, std::memory_order_relaxed) == 1) {
+		int32 expected = -1;
+		parallel.contradiction.compare_exchange_strong(expected, i);
+	}
 
-	double sum = m_sumsOfWeights[p];
-	m_entropies[p] = Math::Log(sum) - m_sumsOfWeightLogWeights[p] / sum;
+	parallel.pending.fetch_add(1, std::memory_order_relaxed);
+	parallel.queues[worker]->push(PackStackEntry(i, t));
 }
+
+template class BasicWfcModel<Topology2D>;
+template class BasicWfcModel<Topology3D>;
@@ -1,72 +1,433 @@
 ﻿# pragma once
 # include "RandomHelper.hpp"
+# include "WfcTopology.hpp"
+# include "WfcRuleSet.hpp"
+# include "ParallelHelper.hpp"
+# include "WorkStealingDeque.hpp"
+# include "RangeCoder.hpp"
+# include <span>
 
-class WfcModel {
+# ifndef WFC_PARALLEL_THRESHOLD
+# define WFC_PARALLEL_THRESHOLD 4096
+# endif
+
+template <class Topology>
+class BasicWfcModel {
 
 public:
 
-	enum class Heuristic { Entropy, MRV, Scanline };
+	using Position = typename Topology::Position;
+	using Extent = typename Topology::Extent;
+	using Region = typename Topology::Region;
+
+	static constexpr int32 Directions = Topology::Directions;
+
+	// Frontier: 確定済みの領域に接する未確定セルからエントロピー最小のものを選び、出力を連結に育てる
+	enum class Heuristic { Entropy, MRV, Scanline, Frontier };
+
+	// 並列伝播に切り替えるスタックの大きさ。wfc_benchmark で測った損益分岐をビルド時に WFC_PARALLEL_THRESHOLD で渡せる
+	static constexpr int32 DefaultParallelThreshold = WFC_PARALLEL_THRESHOLD;
+
+	// 構造ごとの確保済みメモリ量(バイト)
+	struct MemoryFootprint {
+		size_t wave = 0;
+		size_t compatible = 0;
+		size_t propagator = 0;
+		size_t stack = 0;
+		size_t cellStatistics = 0;
+		size_t tileTables = 0;
+		size_t neighbors = 0;
+		// リトライ用に保存した制約適用直後の状態
+		size_t initialState = 0;
+
+		size_t total() const {
+			return wave + compatible + propagator + stack + cellStatistics + tileTables + neighbors + initialState;
+		}
+	};
+
+	// セルcellの候補からタイルtileが外れた
+	struct Ban {
+		int32 cell;
+		int32 tile;
+	};
+
+	// 生成の進み具合を受け取る。登録していなければ各所でポインタを1回調べるだけで済む
+	class Listener {
+	public:
+		virtual ~Listener() = default;
+
+		// clear() で初期状態に戻った。制約による除去はこの直後の onBanned で届く
+		virtual void onCleared() {}
+
+		virtual void onObserved(int32 /*cell*/, int32 /*tile*/) {}
+
+		// 1回の伝播でまとめて届く。観測で落ちたタイルも含む
+		virtual void onBanned(std::span<const Ban> /*bans*/) {}
+
+		virtual void onContradiction(int32 /*cell*/) {}
 
+		// regenerate() で cells の候補が初期状態に戻った。周りの確定したセルとの兼ね合いで落ちたタイルは直後の onBanned で届く
+		virtual void onRegionReset(std::span<const int32> /*cells*/) {}
+
+		virtual void onCompleted() {}
+	};
+
+	// 領域内のセルに置けるタイルを制限する。allowed はタイルごとの可否(長さT)
+	struct Constraint {
+		Region region;
+		Array<bool> allowed;
+	};
+
+	// 支持数が int16 に収まらない規則では ERROR を出して初期化しない。そのときの run() は false を返す
 	void init();
 
 	void clear();
 
 	bool run(int32 seed, int32 limit);
 
+	// 完了した結果のうち region 内のセルだけを初期状態(制約を適用した直後)に戻し、周りの確定したセルに合わせて解き直す
+	// 観測と伝播は領域の中だけで行うので、盤面全体の大きさによらない。矛盾したら元の結果に戻して false
+	// 初期状態を保存していなければ、最初の1回だけ盤面全体の clear() を挟む
+	bool regenerate(const Region& region, int32 seed);
+
+	// 任意の形の領域はセル番号の一覧で渡す
+	bool regenerate(const Array<int32>& cells, int32 seed);
+
 	void runOneStep();
 
 	bool hasCompleted() const;
 
+	// 全セルが確定し、observed() に結果が書き出されているか
+	bool isObservationStored() const {
+		return m_observationStored;
+	}
+
+	// セルごとのタイル番号(未確定は-1)。並びは Topology::Index の順
+	// 結果は完了時にまとめて書き出すので、全セルが埋まっているのは isObservationStored() のときだけ
+	const Array<int32>& observed() const {
+		return m_observed;
+	}
+
+	// 直近の伝播でいずれかのセルの候補が0になったか
+	bool hasContradiction() const {
+		return m_contradiction >= 0;
+	}
+
+	MemoryFootprint memoryFootprint() const;
+
+	// 1回の伝播で積まれた要素が threshold を超えたら、残りを threads 本のスレッドで伝播する。threads <= 1 で逐次のみ
+	// 一致が保証されるのは伝播後の各セルの候補集合だけ。onBanned に届く除去の順番は決まっていない
+	// 重みの和は引く順番が逐次と違うので、エントロピーは末尾のビットで逐次と食い違うことがある
+	void setPropagationThreads(int32 threads, int32 threshold = DefaultParallelThreshold);
+
+	// 大規模モード: 候補・支持数・統計量をセルが変化したときに割り当て、確定したセルからは回収してタイル番号だけを残す
+	// 常駐するのはセルあたり数個のint32だけになり、それ以外のメモリは未確定の前線の大きさに比例する。並列伝播とは併用しない
+	void setLargeGrid(bool enabled);
+
+	void constrain(const Region& region, const Array<bool>& allowed);
+
+	void constrain(const Position& p, const Array<bool>& allowed) {
+		constrain(Topology::CellRegion(p), allowed);
+	}
+
+	void constrainTile(const Region& region, int32 t);
+
+	void constrainTile(const Position& p, int32 t) {
+		constrainTile(Topology::CellRegion(p), t);
+	}
+
+	void clearConstraints();
+
+	// listener は呼び出し側が保持する。nullptr で解除
+	void setListener(Listener* listener);
+
+	// セルごとの矛盾の発生回数。init()以降の全実行分を累積する
+	const Array<int32>& contradictionCounts() const {
+		return m_contradictionCounts;
+	}
+
+	void clearContradictionCounts();
+
+	// 矛盾の発生回数を最大値で正規化したヒートマップ(黒→赤→黄)
+	Image contradictionHeatmap() const requires std::same_as<Topology, Topology2D>;
+
+	const std::shared_ptr<const WfcRuleSet>& rules() const {
+		return m_rules;
+	}
+
+	// 完了した結果を、先に決まった隣から規則表で予測しつつレンジ符号で圧縮する。規則のハッシュと盤面の設定も含む
+	// 先頭の見出し(識別子・版・規則のハッシュ・T・盤面の大きさ・N・折り返し)はリトルエンディアンで書くので、別のアーキテクチャで保存したものも読める
+	Blob encodeResult() const;
+
+	// encodeResult() の出力から探索せずに完了状態を復元する。規則か盤面が一致しなければ false
+	bool decodeResult(const Blob& blob);
+
 protected:
 
-	WfcModel(const Size& gridSize, int32 N, bool periodic, Heuristic heuristic);
+	// 規則は共有し、このオブジェクト自体は1回分の実行状態だけを持つ
+	BasicWfcModel(std::shared_ptr<const WfcRuleSet> rules, const Extent& gridSize, int32 N, bool periodic, Heuristic heuristic);
+
+	int32 cellIndex(const Position& p) const {
+		return Topology::Index(m_gridSize, p);
+	}
 
-	Grid<Array<bool>> m_wave;
+	// セルiの候補・支持数・統計量が置かれている番号。大規模モードでは未割り当て(-1)のことがある
+	int32 slotOf(int32 i) const {
+		return m_largeGrid ? m_slotOf[i] : i;
+	}
 
-	Array<Array<Array<int32>>> m_propagator;
-	Grid<Array<Array<int32>>> m_compatible;
-	Grid<int32> m_observed;
+	// セルiでタイルtがまだ候補に残っているか
+	bool isPossible(int32 i, int32 t) const {
+		const int32 s = slotOf(i);
+		if (s < 0) {
+			// まだ一度も絞られていないか、確定して領域を回収済み
+			return m_observed[i] < 0 || m_observed[i] == t;
+		}
+		return ((m_wave[static_cast<size_t>(s) * m_waveWords + (t >> 6)] >> (t & 63)) & 1) != 0;
+	}
+
+	// セルiに残っているタイルの重みの和
+	double sumOfWeightsAt(int32 i) const {
+		const int32 s = slotOf(i);
+		if (s < 0) {
+			return m_observed[i] < 0 ? m_rules->sumOfWeights : m_rules->weights[m_observed[i]];
+		}
+		return m_sumsOfWeights[s];
+	}
+
+	// 候補・支持数・重みの和とエントロピーはセル番号ではなく slotOf(i) 番目に置く
+	// セルごとにm_waveWords語のビット集合
+	Array<uint64> m_wave;
+	int32 m_waveWords = 0;
+
+	std::shared_ptr<const WfcRuleSet> m_rules;
+
+	// [セル][タイル][方向] の順に詰めた支持数
+	Array<int16> m_compatible;
+	Array<int32> m_observed;
 
 	int32 m_observedSoFar = 0;
 
-	Size m_gridSize{0,0};
+	Extent m_gridSize{};
 
 	int32 m_T = 0;
 	int32 m_N = 0;
 	bool m_periodic = false;
 	bool m_ground = false;
 
-	Array<double> m_weights;
 	Array<double> m_distribution;
 
-	Grid<int32> m_sumsOfOnes;
-	Grid<double> m_sumsOfWeights;
-
+	Array<int32> m_sumsOfOnes;
+	Array<double> m_sumsOfWeights;
 
 	Heuristic m_heuristic;
 
-	const Array<Point> dxy{ { -1, 0}, { 0, 1} , {1, 0},{ 0,-1} };
-	const Array<int32> opposite{ 2, 3, 0, 1 };
-
 private:
 
-	Point nextUnm_observedNode();
+	// T <= 64 のときはセルの候補集合を1ワードのビットマスクで持つ
+	enum class Kernel { Generic, SingleWord };
+
+	int32 cellCount() const {
+		return Topology::CellCount(m_gridSize);
+	}
+
+	// セルiの各方向の隣(なければ-1)。表を持たない大規模モードではその場で求めて buffer に書く
+	const int32* neighborsOf(int32 i, std::array<int32, Directions>& buffer) const {
+		if (not m_neighbors.isEmpty()) {
+			return &m_neighbors[static_cast<size_t>(i) * Directions];
+		}
+
+		const Position p = Topology::Coordinates(m_gridSize, i);
+		for (int32 d = 0; d < Directions; ++d) {
+			buffer[d] = Topology::Neighbor(m_gridSize, m_N, m_periodic, p, d);
+		}
+		return buffer.data();
+	}
+
+	// 観測と書き出しの対象。regenerate() の間は作り直す領域のセル、それ以外は盤面全体
+	int32 activeCellCount() const {
+		return m_region.isEmpty() ? cellCount() : static_cast<int32>(m_region.size());
+	}
+
+	int32 activeCell(int32 k) const {
+		return m_region.isEmpty() ? k : m_region[k];
+	}
+
+	bool isInRegion(int32 i) const {
+		return std::binary_search(m_region.begin(), m_region.end(), i);
+	}
 
-	void observe(const Point& node);
+	int32 nextUnobservedNode();
+
+	int32 nextFrontierNode();
+
+	void enterFrontier(int32 i) {
+		if (m_frontierIndex[i] < 0) {
+			m_frontierIndex[i] = static_cast<int32>(m_frontier.size());
+			m_frontier << i;
+		}
+	}
+
+	void storeObserved();
+
+	int32 ensureSlot(int32 i);
+
+	void resetSlot(int32 s);
+
+	void compactCollapsed();
+
+	bool isCompacted(int32 i) const {
+		return m_largeGrid && m_slotOf[i] < 0 && m_observed[i] >= 0;
+	}
+
+	void applyConstraint(const Region& region, const Array<bool>& allowed);
+
+	void recordContradiction(int32 i);
+
+	void saveInitialState();
+
+	void restoreInitialState();
+
+	void restoreObserved(const Array<int32>& observed);
+
+	// スロットsを初期状態の見本kで上書きする
+	void copySlotTemplate(int32 s, int32 k);
+
+	// セルiをタイルtに確定した状態にする
+	void collapseCell(int32 i, int32 t);
+
+	void observe(int32 node);
 
 	bool propagate();
 
-	void ban(const Point& p, int32 t);
+	bool propagateGeneric();
+
+	// 溜めた除去をリスナーへ渡し、失敗していれば矛盾も知らせる
+	void notifyPropagated(bool success);
+
+	void ban(int32 i, int32 t);
+
+	void observeSingleWord(int32 node);
+
+	bool propagateSingleWord();
+
+	void restrictSingleWord(int32 i, uint64 mask);
+
+	uint64 supportedMask(int32 d, uint64 mask) const;
+
+	uint64 fullSingleWord() const {
+		return m_T >= 64 ? ~uint64{ 0 } : (uint64{ 1 } << m_T) - 1;
+	}
+
+	bool propagateParallel();
+
+	void propagateParallelItem(int32 worker, uint64 item);
 
-	Array<std::pair<Point, int32>> m_stack;
-	int32 m_stacksize = 0;
+	void banParallel(int32 worker, int32 i, int32 t);
 
-	Array<double> m_weightLogWeights;
+	// 上位32bitにセル番号、下位32bitにタイル番号を詰めたエントリ
+	static constexpr uint64 PackStackEntry(int32 index, int32 t) {
+		return (static_cast<uint64>(index) << 32) | static_cast<uint32>(t);
+	}
 
-	Grid<double> m_sumsOfWeightLogWeights;
-	double m_sumOfWeightLogWeights = 0;
-	double m_sumOfWeights = 0;
+	Array<uint64> m_stack;
 
-	Grid<double> m_entropies;
-	double m_startingEntropy = 0;
+	// [セル][方向] → 隣のセル(なければ-1)。折り返しと端の判定を init() で済ませておく
+	Array<int32> m_neighbors;
+
+	// 候補が0になった最初のセル(なければ-1)。見つかった時点で伝播を打ち切る
+	int32 m_contradiction = -1;
+
+	Array<int32> m_contradictionCounts;
+
+	// 並列伝播の作業領域。各(セル, タイル)の除去は wave のビットを原子的に落としたスレッドだけが行う
+	struct ParallelPropagation {
+		WorkerTeam team;
+		Array<std::unique_ptr<WorkStealingDeque>> queues;
+		// スレッドごとに除去した(セル, タイル)。終了後に並べ替えて統計量へ反映する
+		Array<Array<uint64>> banned;
+		std::atomic<int64> pending{ 0 };
+		std::atomic<int32> contradiction{ -1 };
+		int32 threshold = DefaultParallelThreshold;
+
+		explicit ParallelPropagation(int32 threads)
+			: team(threads), banned(threads) {
+			for (int32 k = 0; k < threads; ++k) {
+				queues.push_back(std::make_unique<WorkStealingDeque>());
+			}
+		}
+	};
+
+	std::unique_ptr<ParallelPropagation> m_parallel;
+
+	// 大規模モードの領域はこの枚数単位で伸ばし、空いた番号は m_freeSlots から再利用する
+	static constexpr int32 SlotsPerPage = 1024;
+
+	bool m_largeGrid = false;
+	Array<int32> m_slotOf;
+	Array<int32> m_freeSlots;
+	int32 m_slotCount = 0;
+
+	// Frontier で選ぶ候補。観測したセルの隣と候補が減ったセルを加え、確定したものは選ぶときに外す。並びは選ぶセルに影響しない
+	Array<int32> m_frontier;
+	// セルごとの m_frontier 内の位置(含まれなければ-1)
+	Array<int32> m_frontierIndex;
+
+	// regenerate() で作り直しているセル(昇順)。空なら盤面全体が対象
+	Array<int32> m_region;
+
+	// 今回の伝播で候補が1つになったセル。伝播が成功したら領域を回収する
+	Array<int32> m_collapsed;
+
+	bool m_observationStored = false;
+
+	Listener* m_listener = nullptr;
+
+	// リスナーがいるときだけ除去を記録する
+	Array<Ban> m_banLog;
+
+	bool m_initialized = false;
+
+	Kernel m_kernel = Kernel::Generic;
+
+	// 1セル分の初期支持数 [タイル][方向]
+	Array<int16> m_initialCompatible;
+
+	Array<double> m_sumsOfWeightLogWeights;
+
+	Array<double> m_entropies;
+
+	Array<Constraint> m_constraints;
+
+	// 制約を適用して伝播し終えた状態。リトライ時はここから再開する
+	// スロットごとの候補・支持数・統計量は内容の同じものを1つの見本にまとめ、見本からの複写で戻す
+	struct InitialState {
+		// [見本] ごとの内容
+		Array<uint64> wave;
+		Array<int16> compatible;
+		Array<double> sumsOfWeights;
+		Array<double> sumsOfWeightLogWeights;
+		Array<double> entropies;
+		// [スロット] → 見本の番号
+		Array<int32> slotTemplate;
+
+		Array<int32> observed;
+		Array<int32> sumsOfOnes;
+		Array<int32> slotOf;
+		Array<int32> freeSlots;
+		int32 slotCount = 0;
+		Array<int32> frontier;
+		Array<int32> frontierIndex;
+		// リスナーがいたときだけ記録した、制約による除去
+		Array<Ban> bans;
+		int32 contradiction = -1;
+	};
+
+	InitialState m_initialState;
+	bool m_hasInitialState = false;
+	bool m_constraintsSatisfiable = true;
 };
+
+using WfcModel = BasicWfcModel<Topology2D>;
+
+using WfcModel3D = BasicWfcModel<Topology3D>;
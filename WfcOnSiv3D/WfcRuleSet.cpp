@@ -0,0 +1,126 @@
+﻿# include "stdafx.h"
+# include "WfcRuleSet.hpp"
+# include <bit>
+
+void WfcRuleSet::finalize()
+{
+	T = static_cast<int32>(weights.size());
+
+	weightLogWeights.resize(T);
+	sumOfWeights = 0;
+	sumOfWeightLogWeights = 0;
+
+	for (int32 t = 0; t < T; t++) {
+		weightLogWeights[t] = weights[t] * Math::Log(weights[t]);
+		sumOfWeights += weights[t];
+		sumOfWeightLogWeights += weightLogWeights[t];
+	}
+
+	startingEntropy = Math::Log(sumOfWeights) - sumOfWeightLogWeights / sumOfWeights;
+
+	Fnv1a fnv;
+	fnv.mixBytes(T);
+	for (const double w : weights) {
+		fnv.mixBytes(std::bit_cast<uint64>(w));
+	}
+	for (const auto& pd : propagator) {
+		for (const auto& p : pd) {
+			fnv.mixBytes(p.size());
+			for (const int32 t2 : p) {
+				fnv.mixBytes(t2);
+			}
+		}
+	}
+	hash = fnv.value;
+
+	directions = static_cast<int32>(propagator.size());
+
+	supportTables.clear();
+	supportChunks = 0;
+
+	if (isSingleWord()) {
+		buildSupportTables();
+	}
+
+	packPropagator();
+}
+
+void WfcRuleSet::buildSupportTables()
+{
+	supportChunks = (T + 7) / 8;
+	supportTables.assign(directions * supportChunks * 256, 0);
+
+	for (int32 d = 0; d < directions; d++) {
+		for (int32 k = 0; k < supportChunks; k++) {
+			uint64* table = &supportTables[(d * supportChunks + k) * 256];
+
+			for (int32 bits = 1; bits < 256; bits++) {
+				const int32 j = std::countr_zero(static_cast<uint32>(bits));
+				const int32 t = k * 8 + j;
+
+				uint64 mask = table[bits & (bits - 1)];
+				if (t < T) {
+					for (const int32 t2 : propagator[d][t]) {
+						mask |= uint64{ 1 } << t2;
+					}
+				}
+				table[bits] = mask;
+			}
+		}
+	}
+}
+
+void WfcRuleSet::packPropagator()
+{
+	propagatorLists.assign(directions * T, 0);
+	propagatorOffsets.assign(1, 0);
+	propagatorTiles16.clear();
+	propagatorTiles32.clear();
+
+	const bool narrow = T <= 65536;
+
+	// 内容のハッシュ → 同じハッシュを持つ一覧の番号
+	HashTable<uint64, Array<int32>> buckets;
+	Array<const Array<int32>*> unique;
+
+	for (int32 d = 0; d < directions; d++) {
+		for (int32 t = 0; t < T; t++) {
+			const Array<int32>& p = propagator[d][t];
+
+			Fnv1a fnv;
+			fnv.mix(p.size());
+			for (const int32 t2 : p) {
+				fnv.mix(static_cast<uint32>(t2));
+			}
+
+			propagatorLists[d * T + t] = FindOrAddUnique(buckets, fnv.value, [&](int32 c) { return *unique[c] == p; }, [&] {
+				unique << &p;
+
+				for (const int32 t2 : p) {
+					if (narrow) {
+						propagatorTiles16 << static_cast<uint16>(t2);
+					}
+					else {
+						propagatorTiles32 << t2;
+					}
+				}
+				propagatorOffsets << static_cast<int32>(narrow ? propagatorTiles16.size() : propagatorTiles32.size());
+
+				return static_cast<int32>(unique.size() - 1);
+			});
+		}
+	}
+
+	propagatorTiles16.shrink_to_fit();
+	propagatorTiles32.shrink_to_fit();
+
+	propagator.clear();
+	propagator.shrink_to_fit();
+}
+
+size_t WfcRuleSet::propagatorBytes() const
+{
+	return (propagatorLists.capacity() + propagatorOffsets.capacity() + propagatorTiles32.capacity()) * sizeof(int32)
+		+ propagatorTiles16.capacity() * sizeof(uint16)
+		+ supportTables.capacity() * sizeof(uint64);
+}
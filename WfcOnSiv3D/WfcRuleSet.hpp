@@ -0,0 +1,109 @@
+﻿# pragma once
+
+// FNV-1a。規則の照合と、同じ内容のものをまとめるときの振り分けに使う
+struct Fnv1a {
+	uint64 value = 0xcbf29ce484222325;
+
+	// 1語をそのまま混ぜる
+	void mix(uint64 word) {
+		value = (value ^ word) * 0x100000001b3;
+	}
+
+	// 下位から1バイトずつ混ぜる
+	void mixBytes(uint64 word) {
+		for (int32 k = 0; k < 8; k++, word >>= 8) {
+			mix(word & 0xFF);
+		}
+	}
+};
+
+// 内容のハッシュ → 同じハッシュを持つものの番号。same(k) が真になる番号があればそれを、なければ add() で作った番号を登録して返す
+template <class Same, class Add>
+int32 FindOrAddUnique(HashTable<uint64, Array<int32>>& buckets, uint64 hash, Same same, Add add) {
+	Array<int32>& candidates = buckets[hash];
+	for (const int32 k : candidates) {
+		if (same(k)) {
+			return k;
+		}
+	}
+
+	const int32 k = add();
+	candidates << k;
+	return k;
+}
+
+// モデルの読み込み結果のうち、実行ごとに変わらない部分。
+// 読み込み後は const で共有するだけなので、同じ規則から複数のモデル(スレッド)を同時に動かせる
+struct WfcRuleSet {
+
+	static constexpr int32 MaxSingleWordTiles = 64;
+
+	int32 T = 0;
+
+	Array<double> weights;
+
+	// [方向][タイル] → 隣に置けるタイルの一覧。読み込み時に組み立て、finalize() で下の詰めた形に移して解放する
+	Array<Array<Array<int32>>> propagator;
+
+	// 以下は finalize() で weights と propagator から求める
+	int32 directions = 0;
+	Array<double> weightLogWeights;
+	double sumOfWeights = 0;
+	double sumOfWeightLogWeights = 0;
+	double startingEntropy = 0;
+
+	// T・weights・propagator の FNV-1a。保存した結果がこの規則で作られたものか確かめる
+	uint64 hash = 0;
+
+	// T <= 64 のとき、方向d、バイト位置kの候補8タイル分について隣接セルに許されるタイル集合を引く表
+	Array<uint64> supportTables;
+	int32 supportChunks = 0;
+
+	// 同じ内容の一覧は1つにまとめ、すべての一覧を1本の配列に続けて置く。(方向d, タイルt)の一覧は propagatorLists[d * T + t] 番目
+	Array<int32> propagatorLists;
+	Array<int32> propagatorOffsets;
+	// T <= 65536 なら16bitの側だけ、そうでなければ32bitの側だけを使う
+	Array<uint16> propagatorTiles16;
+	Array<int32> propagatorTiles32;
+
+	int32 compatibleCount(int32 d, int32 t) const {
+		const int32 list = propagatorLists[d * T + t];
+		return propagatorOffsets[list + 1] - propagatorOffsets[list];
+	}
+
+	// 方向dの隣にタイルtがあるとき、このセルに置けるタイルを順に f に渡す
+	template <class Fn>
+	void eachCompatible(int32 d, int32 t, Fn f) const {
+		const int32 list = propagatorLists[d * T + t];
+		const int32 begin = propagatorOffsets[list];
+		const int32 end = propagatorOffsets[list + 1];
+
+		if (not propagatorTiles16.isEmpty()) {
+			const uint16* tiles = propagatorTiles16.data();
+			for (int32 k = begin; k < end; k++) {
+				f(static_cast<int32>(tiles[k]));
+			}
+		}
+		else {
+			const int32* tiles = propagatorTiles32.data();
+			for (int32 k = begin; k < end; k++) {
+				f(tiles[k]);
+			}
+		}
+	}
+
+	bool isSingleWord() const {
+		return T <= MaxSingleWordTiles;
+	}
+
+	// 読み込みの最後に1度だけ呼ぶ
+	void finalize();
+
+	size_t propagatorBytes() const;
+
+private:
+
+	void buildSupportTables();
+
+	void packPropagator();
+};
@@ -0,0 +1,480 @@
+﻿// zlib の Byte が wfc::Byte とぶつからないよう、stdafx.h より先に読む
+# ifdef WFC_HAVE_ZLIB
+# include <zlib.h>
+# endif
+# include "stdafx.h"
+
+# ifdef WFC_STANDALONE
+# include <fstream>
+
+namespace wfc
+{
+	namespace
+	{
+		ImageLoader& CurrentImageLoader() {
+			static ImageLoader loader;
+			return loader;
+		}
+
+		std::string ReadFile(FilePathView path) {
+			std::ifstream in(Unicode::ToUTF8(path), std::ios::binary);
+			if (not in) {
+				return {};
+			}
+
+			std::ostringstream os;
+			os << in.rdbuf();
+			return os.str();
+		}
+
+		uint32 Crc32(const uint8* data, size_t size) {
+			static const std::array<uint32, 256> table = [] {
+				std::array<uint32, 256> result{};
+				for (uint32 n = 0; n < 256; ++n) {
+					uint32 c = n;
+					for (int32 k = 0; k < 8; ++k) {
+						c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+					}
+					result[n] = c;
+				}
+				return result;
+			}();
+
+			uint32 crc = 0xFFFFFFFFu;
+			for (size_t i = 0; i < size; ++i) {
+				crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+			}
+			return crc ^ 0xFFFFFFFFu;
+		}
+
+# ifndef WFC_HAVE_ZLIB
+		uint32 Adler32(const uint8* data, size_t size) {
+			uint32 a = 1;
+			uint32 b = 0;
+			for (size_t i = 0; i < size; ++i) {
+				a = (a + data[i]) % 65521;
+				b = (b + a) % 65521;
+			}
+			return (b << 16) | a;
+		}
+# endif
+
+		// 再帰下降で1つの値を読む。壊れた入力では読めたところまでを返す
+		class JsonParser
+		{
+		public:
+
+			explicit JsonParser(std::string_view text)
+				: m_text(text) {}
+
+			std::shared_ptr<JSON::Node> parseValue() {
+				auto node = std::make_shared<JSON::Node>();
+				skipSpaces();
+
+				if (m_position >= m_text.size()) {
+					return node;
+				}
+
+				const char c = m_text[m_position];
+
+				if (c == '{' || c == '[') {
+					const bool object = c == '{';
+					const char close = object ? '}' : ']';
+					node->type = object ? JSON::Node::Type::Object : JSON::Node::Type::Array;
+					m_position++;
+
+					for (size_t index = 0; ; index++) {
+						skipSpaces();
+						if (m_position >= m_text.size() || m_text[m_position] == close) {
+							break;
+						}
+
+						String key;
+						if (object) {
+							key = parseString();
+							skipSpaces();
+							if (m_position < m_text.size() && m_text[m_position] == ':') {
+								m_position++;
+							}
+						}
+						else {
+							key = Unicode::FromUTF8(std::to_string(index));
+						}
+
+						node->members << JSON::Member{ std::move(key), JSON(parseValue()) };
+
+						skipSpaces();
+						if (m_position < m_text.size() && m_text[m_position] == ',') {
+							m_position++;
+						}
+					}
+					m_position++;
+				}
+				else if (c == '"') {
+					node->type = JSON::Node::Type::String;
+					node->string = parseString();
+				}
+				else if (m_text.substr(m_position, 4) == "true") {
+					node->type = JSON::Node::Type::Bool;
+					node->boolean = true;
+					m_position += 4;
+				}
+				else if (m_text.substr(m_position, 5) == "false") {
+					node->type = JSON::Node::Type::Bool;
+					m_position += 5;
+				}
+				else if (m_text.substr(m_position, 4) == "null") {
+					m_position += 4;
+				}
+				else {
+					node->type = JSON::Node::Type::Number;
+					const auto result = std::from_chars(m_text.data() + m_position, m_text.data() + m_text.size(), node->number);
+					m_position = result.ptr - m_text.data() + (result.ec != std::errc{} ? 1 : 0);
+				}
+
+				return node;
+			}
+
+		private:
+
+			void skipSpaces() {
+				while (m_position < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_position]))) {
+					m_position++;
+				}
+			}
+
+			uint32 parseHex4() {
+				uint32 value = 0;
+				for (int32 k = 0; k < 4 && m_position < m_text.size(); k++) {
+					const char h = m_text[m_position++];
+					value = value * 16 + (h <= '9' ? h - '0' : (h | 0x20) - 'a' + 10);
+				}
+				return value;
+			}
+
+			String parseString() {
+				std::string result;
+				m_position++;
+
+				while (m_position < m_text.size() && m_text[m_position] != '"') {
+					char c = m_text[m_position++];
+					if (c != '\\' || m_position >= m_text.size()) {
+						result += c;
+						continue;
+					}
+
+					c = m_text[m_position++];
+					switch (c) {
+					case 'n': result += '\n'; break;
+					case 't': result += '\t'; break;
+					case 'r': result += '\r'; break;
+					case 'b': result += '\b'; break;
+					case 'f': result += '\f'; break;
+					case 'u': {
+						uint32 code = parseHex4();
+						if (code >= 0xD800 && code < 0xDC00 && m_text.substr(m_position, 2) == "\\u") {
+							m_position += 2;
+							code = 0x10000 + ((code - 0xD800) << 10) + (parseHex4() - 0xDC00);
+						}
+						result += Unicode::ToUTF8(String(1, static_cast<char32>(code)));
+						break;
+					}
+					default: result += c; break;
+					}
+				}
+				m_position++;
+
+				return Unicode::FromUTF8(result);
+			}
+
+			std::string_view m_text;
+			size_t m_position = 0;
+		};
+	}
+
+	Array<String> String::split(char32 separator) const {
+		Array<String> result;
+		String current;
+
+		for (const char32 c : *this) {
+			if (c == separator) {
+				result << current;
+				current.clear();
+			}
+			else {
+				current += c;
+			}
+		}
+		result << current;
+
+		return result;
+	}
+
+	namespace Unicode
+	{
+		std::string ToUTF8(const String& s) {
+			std::string result;
+			result.reserve(s.size());
+
+			for (const char32 c : s) {
+				if (c < 0x80) {
+					result += static_cast<char>(c);
+				}
+				else if (c < 0x800) {
+					result += static_cast<char>(0xC0 | (c >> 6));
+					result += static_cast<char>(0x80 | (c & 0x3F));
+				}
+				else if (c < 0x10000) {
+					result += static_cast<char>(0xE0 | (c >> 12));
+					result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+					result += static_cast<char>(0x80 | (c & 0x3F));
+				}
+				else {
+					result += static_cast<char>(0xF0 | (c >> 18));
+					result += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+					result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+					result += static_cast<char>(0x80 | (c & 0x3F));
+				}
+			}
+
+			return result;
+		}
+
+		String FromUTF8(std::string_view s) {
+			String result;
+			result.reserve(s.size());
+
+			for (size_t i = 0; i < s.size();) {
+				const uint8 lead = static_cast<uint8>(s[i]);
+				const int32 length = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+
+				char32 c = length == 1 ? lead : lead & (0x3F >> (length - 1));
+				for (int32 k = 1; k < length && i + k < s.size(); k++) {
+					c = (c << 6) | (static_cast<uint8>(s[i + k]) & 0x3F);
+				}
+
+				result += c;
+				i += length;
+			}
+
+			return result;
+		}
+	}
+
+	std::ostream& operator<<(std::ostream& os, const String& s) {
+		return os << Unicode::ToUTF8(s);
+	}
+
+	Image::Image(FilePathView path) {
+		if (not CurrentImageLoader()) {
+			std::cout << "ERROR: no image loader is set for " << path << std::endl;
+			return;
+		}
+		*this = CurrentImageLoader()(path);
+	}
+
+	Blob Image::encodePNG() const {
+		Array<uint8> png;
+
+		const auto putBytes = [&](const void* data, size_t size) {
+			const uint8* bytes = static_cast<const uint8*>(data);
+			png.insert(png.end(), bytes, bytes + size);
+		};
+		const auto put32 = [&](uint32 value) {
+			const uint8 bytes[4] = { uint8(value >> 24), uint8(value >> 16), uint8(value >> 8), uint8(value) };
+			putBytes(bytes, 4);
+		};
+		const auto putChunk = [&](const char* type, const Array<uint8>& data) {
+			put32(static_cast<uint32>(data.size()));
+			const size_t begin = png.size();
+			putBytes(type, 4);
+			putBytes(data.data(), data.size());
+			put32(Crc32(png.data() + begin, png.size() - begin));
+		};
+
+		const uint8 signature[8] = { uint8(0x89), uint8('P'), uint8('N'), uint8('G'), uint8('\r'), uint8('\n'), uint8(0x1A), uint8('\n') };
+		putBytes(signature, 8);
+
+		// 幅・高さ・8bit・RGBA・圧縮/フィルタ/インタレースなし
+		Array<uint8> header;
+		for (const uint32 value : { static_cast<uint32>(m_width), static_cast<uint32>(m_height) }) {
+			for (int32 shift = 24; shift >= 0; shift -= 8) {
+				header << uint8(value >> shift);
+			}
+		}
+		for (const uint8 value : { 8, 6, 0, 0, 0 }) {
+			header << uint8(value);
+		}
+		putChunk("IHDR", header);
+
+		// 行ごとに5種類のフィルタを試し、差分の絶対値の和が最小のものを使う(PNG仕様の推奨する選び方)
+		const size_t stride = m_width * 4;
+		Array<uint8> raw;
+		raw.reserve(m_height * (1 + stride));
+
+		Array<uint8> previous(stride, 0);
+		Array<uint8> current(stride);
+		std::array<Array<uint8>, 5> filtered;
+		for (auto& row : filtered) {
+			row.resize(stride);
+		}
+
+		for (size_t y = 0; y < m_height; ++y) {
+			const Color* pixels = (*this)[y];
+			for (size_t x = 0; x < m_width; ++x) {
+				current[x * 4 + 0] = pixels[x].r;
+				current[x * 4 + 1] = pixels[x].g;
+				current[x * 4 + 2] = pixels[x].b;
+				current[x * 4 + 3] = pixels[x].a;
+			}
+
+			for (size_t k = 0; k < stride; ++k) {
+				const int32 a = k >= 4 ? current[k - 4] : 0;
+				const int32 b = previous[k];
+				const int32 c = k >= 4 ? previous[k - 4] : 0;
+				const int32 p = a + b - c;
+				const int32 pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+				const int32 paeth = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+
+				filtered[0][k] = current[k];
+				filtered[1][k] = static_cast<uint8>(current[k] - a);
+				filtered[2][k] = static_cast<uint8>(current[k] - b);
+				filtered[3][k] = static_cast<uint8>(current[k] - (a + b) / 2);
+				filtered[4][k] = static_cast<uint8>(current[k] - paeth);
+			}
+
+			int32 best = 0;
+			uint64 bestCost = UINT64_MAX;
+			for (int32 f = 0; f < 5; ++f) {
+				uint64 cost = 0;
+				for (const uint8 v : filtered[f]) {
+					cost += v < 128 ? v : 256 - v;
+				}
+				if (cost < bestCost) {
+					best = f;
+					bestCost = cost;
+				}
+			}
+
+			raw << static_cast<uint8>(best);
+			raw.insert(raw.end(), filtered[best].begin(), filtered[best].end());
+			std::swap(previous, current);
+		}
+
+# ifdef WFC_HAVE_ZLIB
+		uLongf compressedSize = compressBound(static_cast<uLong>(raw.size()));
+		Array<uint8> zlib(compressedSize);
+		if (compress2(zlib.data(), &compressedSize, raw.data(), static_cast<uLong>(raw.size()), Z_DEFAULT_COMPRESSION) != Z_OK) {
+			std::cout << "ERROR: failed to compress a PNG" << std::endl;
+			return {};
+		}
+		zlib.resize(compressedSize);
+# else
+		// zlib がなければ無圧縮ブロックに65535バイトずつ分けて包む
+		Array<uint8> zlib{ uint8(0x78), uint8(0x01) };
+		for (size_t offset = 0; offset < raw.size() || offset == 0; offset += 65535) {
+			const size_t length = Min<size_t>(raw.size() - offset, 65535);
+			const bool last = offset + length == raw.size();
+			zlib << uint8(last ? 1 : 0) << uint8(length) << uint8(length >> 8) << uint8(~length) << uint8(~length >> 8);
+			zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+			if (last) {
+				break;
+			}
+		}
+
+		const uint32 adler = Adler32(raw.data(), raw.size());
+		for (int32 shift = 24; shift >= 0; shift -= 8) {
+			zlib << uint8(adler >> shift);
+		}
+# endif
+		putChunk("IDAT", zlib);
+		putChunk("IEND", {});
+
+		return Blob(png.data(), png.size());
+	}
+
+	void SetImageLoader(ImageLoader loader) {
+		CurrentImageLoader() = std::move(loader);
+	}
+
+	Blob::Blob(FilePathView path) {
+		const std::string bytes = ReadFile(path);
+		const Byte* data = reinterpret_cast<const Byte*>(bytes.data());
+		m_data.assign(data, data + bytes.size());
+	}
+
+	bool Blob::save(FilePathView path) const {
+		std::ofstream out(Unicode::ToUTF8(path), std::ios::binary);
+		out.write(reinterpret_cast<const char*>(m_data.data()), m_data.size());
+		return static_cast<bool>(out);
+	}
+
+	JSON JSON::Load(FilePathView path) {
+		const std::string text = ReadFile(path);
+		if (text.empty()) {
+			std::cout << "ERROR: failed to load " << path << std::endl;
+			return {};
+		}
+		return Parse(text);
+	}
+
+	JSON JSON::Parse(std::string_view text) {
+		return JSON(JsonParser(text).parseValue());
+	}
+
+	bool JSON::hasElement(const String& name) const {
+		return not (*this)[name].isEmpty();
+	}
+
+	JSON JSON::operator[](const String& name) const {
+		if (m_node && m_node->type == Node::Type::Object) {
+			for (const auto& member : m_node->members) {
+				if (member.key == name) {
+					return member.value;
+				}
+			}
+		}
+		return {};
+	}
+
+	String JSON::getString() const {
+		return m_node && m_node->type == Node::Type::String ? m_node->string : String{};
+	}
+
+	bool JSON::getBool() const {
+		return m_node && m_node->type == Node::Type::Bool && m_node->boolean;
+	}
+
+	double JSON::getNumber() const {
+		return m_node && m_node->type == Node::Type::Number ? m_node->number : 0.0;
+	}
+
+	JSON::Iterator JSON::begin() const {
+		return { m_node.get(), 0 };
+	}
+
+	JSON::Iterator JSON::end() const {
+		return { m_node.get(), m_node ? m_node->members.size() : 0 };
+	}
+
+	namespace FileSystem
+	{
+		String BaseName(FilePathView path) {
+			const size_t slash = path.find_last_of(U"/\\");
+			String name = slash == String::npos ? path : String(path.substr(slash + 1));
+
+			const size_t dot = name.find_last_of(U'.');
+			if (dot != String::npos) {
+				name.resize(dot);
+			}
+			return name;
+		}
+	}
+
+	std::mt19937_64& GetDefaultRNG() {
+		static thread_local std::mt19937_64 engine{ std::random_device{}() };
+		return engine;
+	}
+}
+
+# endif
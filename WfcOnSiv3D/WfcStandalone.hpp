@@ -0,0 +1,606 @@
+﻿# pragma once
+# include <algorithm>
+# include <array>
+# include <atomic>
+# include <bit>
+# include <cctype>
+# include <charconv>
+# include <cmath>
+# include <cstdint>
+# include <cstring>
+# include <functional>
+# include <iostream>
+# include <memory>
+# include <random>
+# include <span>
+# include <sstream>
+# include <string>
+# include <thread>
+# include <unordered_map>
+# include <vector>
+
+// WFC_STANDALONE のときに Siv3D の代わりに使う、ソルバー本体が必要とする分だけの型と関数。
+// 名前と振る舞いは Siv3D に合わせてあるので、本体のコードはどちらでも同じようにビルドできる。
+// 乱数列は Siv3D と異なるため、同じシードでも Siv3D 版と同じ結果にはならない
+namespace wfc
+{
+	using int8 = std::int8_t;
+	using int16 = std::int16_t;
+	using int32 = std::int32_t;
+	using int64 = std::int64_t;
+	using uint8 = std::uint8_t;
+	using uint16 = std::uint16_t;
+	using uint32 = std::uint32_t;
+	using uint64 = std::uint64_t;
+	using char32 = char32_t;
+	using Byte = std::byte;
+
+	template <class Type>
+	constexpr const Type& Min(const Type& a, const Type& b) {
+		return b < a ? b : a;
+	}
+
+	template <class Type>
+	constexpr const Type& Max(const Type& a, const Type& b) {
+		return a < b ? b : a;
+	}
+
+	template <class Type>
+	constexpr const Type& Clamp(const Type& v, const Type& min, const Type& max) {
+		return v < min ? min : (max < v ? max : v);
+	}
+
+	template <class Type>
+	class Array : public std::vector<Type>
+	{
+	public:
+
+		using std::vector<Type>::vector;
+
+		Array& operator<<(const Type& value) {
+			this->push_back(value);
+			return *this;
+		}
+
+		Array& operator<<(Type&& value) {
+			this->push_back(std::move(value));
+			return *this;
+		}
+
+		bool isEmpty() const {
+			return this->empty();
+		}
+
+		Array& fill(const Type& value) {
+			std::fill(this->begin(), this->end(), value);
+			return *this;
+		}
+
+		Type sum() const {
+			Type result{};
+			for (const auto& value : *this) {
+				result += value;
+			}
+			return result;
+		}
+
+		bool contains(const Type& value) const {
+			return std::find(this->begin(), this->end(), value) != this->end();
+		}
+	};
+
+	template <class Type>
+	struct Vector2D {
+		Type x{};
+		Type y{};
+
+		constexpr Vector2D() = default;
+
+		constexpr Vector2D(Type _x, Type _y)
+			: x(_x), y(_y) {}
+
+		constexpr Vector2D operator+(const Vector2D& other) const {
+			return { x + other.x, y + other.y };
+		}
+
+		constexpr Vector2D operator-(const Vector2D& other) const {
+			return { x - other.x, y - other.y };
+		}
+
+		constexpr Vector2D operator*(Type s) const {
+			return { x * s, y * s };
+		}
+
+		constexpr bool operator==(const Vector2D& other) const = default;
+	};
+
+	using Point = Vector2D<int32>;
+	using Size = Point;
+
+	struct Rect {
+		int32 x = 0;
+		int32 y = 0;
+		int32 w = 0;
+		int32 h = 0;
+
+		constexpr Rect() = default;
+
+		constexpr Rect(int32 _x, int32 _y, int32 _w, int32 _h)
+			: x(_x), y(_y), w(_w), h(_h) {}
+
+		constexpr Rect(const Point& pos, const Size& size)
+			: x(pos.x), y(pos.y), w(size.x), h(size.y) {}
+
+		constexpr Rect(const Point& pos, int32 size)
+			: x(pos.x), y(pos.y), w(size), h(size) {}
+	};
+
+	template <class Type>
+	class Grid
+	{
+	public:
+
+		using value_type = Type;
+
+		Grid() = default;
+
+		Grid(size_t w, size_t h)
+			: m_width(w), m_height(h), m_data(w * h) {}
+
+		Grid(size_t w, size_t h, const Type& value)
+			: m_width(w), m_height(h), m_data(w * h, value) {}
+
+		Grid(size_t w, size_t h, const Array<Type>& data)
+			: m_width(w), m_height(h), m_data(data) {}
+
+		explicit Grid(const Size& size)
+			: Grid(size.x, size.y) {}
+
+		Grid(const Size& size, const Type& value)
+			: Grid(size.x, size.y, value) {}
+
+		Type* operator[](size_t y) {
+			return m_data.data() + y * m_width;
+		}
+
+		const Type* operator[](size_t y) const {
+			return m_data.data() + y * m_width;
+		}
+
+		Type& operator[](const Point& p) {
+			return m_data[p.y * m_width + p.x];
+		}
+
+		const Type& operator[](const Point& p) const {
+			return m_data[p.y * m_width + p.x];
+		}
+
+		size_t width() const {
+			return m_width;
+		}
+
+		size_t height() const {
+			return m_height;
+		}
+
+		Size size() const {
+			return { static_cast<int32>(m_width), static_cast<int32>(m_height) };
+		}
+
+		size_t num_elements() const {
+			return m_data.size();
+		}
+
+		bool isEmpty() const {
+			return m_data.empty();
+		}
+
+		const Array<Type>& asArray() const {
+			return m_data;
+		}
+
+		Type* data() {
+			return m_data.data();
+		}
+
+		const Type* data() const {
+			return m_data.data();
+		}
+
+		void fill(const Type& value) {
+			m_data.fill(value);
+		}
+
+	private:
+
+		size_t m_width = 0;
+		size_t m_height = 0;
+		Array<Type> m_data;
+	};
+
+	struct Color {
+		uint8 r = 0;
+		uint8 g = 0;
+		uint8 b = 0;
+		uint8 a = 255;
+
+		constexpr Color() = default;
+
+		constexpr Color(uint8 _r, uint8 _g, uint8 _b, uint8 _a = 255)
+			: r(_r), g(_g), b(_b), a(_a) {}
+
+		constexpr bool operator==(const Color& other) const = default;
+
+		constexpr uint32 asUint32() const {
+			return static_cast<uint32>(r) | (static_cast<uint32>(g) << 8) | (static_cast<uint32>(b) << 16) | (static_cast<uint32>(a) << 24);
+		}
+	};
+
+	class String : public std::u32string
+	{
+	public:
+
+		using std::u32string::u32string;
+
+		String(const std::u32string& s)
+			: std::u32string(s) {}
+
+		bool isEmpty() const {
+			return empty();
+		}
+
+		bool contains(char32 c) const {
+			return find(c) != npos;
+		}
+
+		Array<String> split(char32 separator) const;
+	};
+
+	using FilePath = String;
+	using FilePathView = const String&;
+
+	namespace Unicode
+	{
+		std::string ToUTF8(const String& s);
+
+		String FromUTF8(std::string_view s);
+	}
+
+	std::ostream& operator<<(std::ostream& os, const String& s);
+
+	// 数値として読めなければ0
+	template <class Type>
+	Type Parse(const String& s) {
+		const std::string text = Unicode::ToUTF8(s);
+		Type value{};
+		std::from_chars(text.data(), text.data() + text.size(), value);
+		return value;
+	}
+
+	namespace detail
+	{
+		struct FormatString {
+			String format;
+
+			// "{}" を引数で順に置き換える
+			template <class... Args>
+			String operator()(const Args&... args) const {
+				const std::string parts[] = { ToText(args)..., std::string{} };
+				const std::string source = Unicode::ToUTF8(format);
+
+				std::string result;
+				size_t k = 0;
+				for (size_t i = 0; i < source.size(); i++) {
+					if (source[i] == '{' && i + 1 < source.size() && source[i + 1] == '}' && k < sizeof...(Args)) {
+						result += parts[k++];
+						i++;
+					}
+					else {
+						result += source[i];
+					}
+				}
+				return Unicode::FromUTF8(result);
+			}
+
+			template <class Value>
+			static std::string ToText(const Value& value) {
+				std::ostringstream os;
+				os << value;
+				return os.str();
+			}
+		};
+	}
+
+	inline detail::FormatString operator""_fmt(const char32* s, size_t length) {
+		return { String(s, length) };
+	}
+
+	class Blob;
+
+	class Image
+	{
+	public:
+
+		Image() = default;
+
+		explicit Image(const Size& size)
+			: m_width(size.x), m_height(size.y), m_data(static_cast<size_t>(size.x) * size.y) {}
+
+		Image(size_t w, size_t h, const Color& color = Color{})
+			: m_width(w), m_height(h), m_data(w * h, color) {}
+
+		// SetImageLoader() で登録した関数で読み込む
+		explicit Image(FilePathView path);
+
+		int32 width() const {
+			return static_cast<int32>(m_width);
+		}
+
+		int32 height() const {
+			return static_cast<int32>(m_height);
+		}
+
+		Size size() const {
+			return { width(), height() };
+		}
+
+		Color* operator[](size_t y) {
+			return m_data.data() + y * m_width;
+		}
+
+		const Color* operator[](size_t y) const {
+			return m_data.data() + y * m_width;
+		}
+
+		Color* data() {
+			return m_data.data();
+		}
+
+		const Color* data() const {
+			return m_data.data();
+		}
+
+		const Array<Color>& asArray() const {
+			return m_data;
+		}
+
+		bool isEmpty() const {
+			return m_data.empty();
+		}
+
+		size_t num_pixels() const {
+			return m_data.size();
+		}
+
+		// RGBA の PNG にする。zlib があれば(WFC_HAVE_ZLIB)圧縮し、なければ無圧縮ブロックで包む
+		Blob encodePNG() const;
+
+	private:
+
+		size_t m_width = 0;
+		size_t m_height = 0;
+		Array<Color> m_data;
+	};
+
+	// 画像形式のデコーダは持たないので、埋め込み先が読み込み関数を渡す
+	using ImageLoader = std::function<Image(FilePathView)>;
+
+	void SetImageLoader(ImageLoader loader);
+
+	class Blob
+	{
+	public:
+
+		Blob() = default;
+
+		Blob(const void* data, size_t size)
+			: m_data(static_cast<const Byte*>(data), static_cast<const Byte*>(data) + size) {}
+
+		explicit Blob(FilePathView path);
+
+		const Byte* data() const {
+			return m_data.data();
+		}
+
+		size_t size() const {
+			return m_data.size();
+		}
+
+		bool isEmpty() const {
+			return m_data.empty();
+		}
+
+		bool save(FilePathView path) const;
+
+	private:
+
+		Array<Byte> m_data;
+	};
+
+	// 読み込み専用の JSON。存在しない要素を引くと空の値が返る
+	class JSON
+	{
+	public:
+
+		struct Node;
+
+		struct Member;
+
+		class Iterator;
+
+		JSON() = default;
+
+		explicit JSON(std::shared_ptr<const Node> node)
+			: m_node(std::move(node)) {}
+
+		static JSON Load(FilePathView path);
+
+		static JSON Parse(std::string_view text);
+
+		bool isEmpty() const {
+			return m_node == nullptr;
+		}
+
+		bool hasElement(const String& name) const;
+
+		JSON operator[](const String& name) const;
+
+		String getString() const;
+
+		template <class Type>
+		Type get() const {
+			if constexpr (std::is_same_v<Type, String>) {
+				return getString();
+			}
+			else if constexpr (std::is_same_v<Type, bool>) {
+				return getBool();
+			}
+			else {
+				return static_cast<Type>(getNumber());
+			}
+		}
+
+		// 配列は要素を(添字, 値)として、オブジェクトはメンバーを(名前, 値)として順に返す
+		Iterator begin() const;
+
+		Iterator end() const;
+
+	private:
+
+		bool getBool() const;
+
+		double getNumber() const;
+
+		std::shared_ptr<const Node> m_node;
+	};
+
+	struct JSON::Member {
+		String key;
+		JSON value;
+	};
+
+	struct JSON::Node {
+		enum class Type { Null, Bool, Number, String, Array, Object };
+
+		Type type = Type::Null;
+		bool boolean = false;
+		double number = 0;
+		String string;
+		Array<Member> members;
+	};
+
+	class JSON::Iterator
+	{
+	public:
+
+		Iterator(const Node* node, size_t index)
+			: m_node(node), m_index(index) {}
+
+		// Siv3D と同じく値で返す(const auto&& で受けられるように)
+		Member operator*() const {
+			return m_node->members[m_index];
+		}
+
+		Iterator& operator++() {
+			m_index++;
+			return *this;
+		}
+
+		bool operator!=(const Iterator& other) const {
+			return m_index != other.m_index;
+		}
+
+	private:
+
+		const Node* m_node;
+		size_t m_index;
+	};
+
+	namespace FileSystem
+	{
+		// 拡張子を除いたファイル名
+		String BaseName(FilePathView path);
+	}
+
+	namespace Math
+	{
+		inline double Log(double x) {
+			return std::log(x);
+		}
+	}
+
+	namespace Threading
+	{
+		inline size_t GetConcurrency() {
+			return Max(std::thread::hardware_concurrency(), 1u);
+		}
+	}
+
+	// Siv3D と同じく、既定の乱数はスレッドごとに持つ
+	std::mt19937_64& GetDefaultRNG();
+
+	inline void Reseed(uint64 seed) {
+		GetDefaultRNG().seed(seed);
+	}
+
+	template <class Type>
+	Type Random(Type min, Type max) {
+		if constexpr (std::is_floating_point_v<Type>) {
+			return std::uniform_real_distribution<Type>(min, max)(GetDefaultRNG());
+		}
+		else {
+			return std::uniform_int_distribution<Type>(min, max)(GetDefaultRNG());
+		}
+	}
+
+	// Siv3D と同じく、数える型は count の型に合わせる
+	template <class Count>
+	struct StepRange {
+		Count count;
+
+		struct Iterator {
+			Count i;
+
+			Count operator*() const {
+				return i;
+			}
+
+			Iterator& operator++() {
+				i++;
+				return *this;
+			}
+
+			bool operator!=(const Iterator& other) const {
+				return i != other.i;
+			}
+		};
+
+		Iterator begin() const {
+			return { Count{ 0 } };
+		}
+
+		Iterator end() const {
+			return { count };
+		}
+	};
+
+	template <class Count>
+	StepRange<Count> step(Count count) {
+		return { count };
+	}
+}
+
+template <>
+struct std::hash<wfc::String> {
+	size_t operator()(const wfc::String& s) const {
+		return std::hash<std::u32string>{}(s);
+	}
+};
+
+namespace wfc
+{
+	template <class Key, class Value>
+	using HashTable = std::unordered_map<Key, Value>;
+}
+
+using namespace wfc;
@@ -0,0 +1,165 @@
+﻿# pragma once
+
+// 盤面の形と隣接関係。WfcModelの方向数・近傍計算はここからコンパイル時に決まる
+
+struct Topology2D {
+
+	using Position = Point;
+	using Extent = Size;
+	using Region = Rect;
+
+	static constexpr int32 Directions = 4;
+
+	static constexpr std::array<Position, Directions> Offsets{ Point{ -1, 0 }, Point{ 0, 1 }, Point{ 1, 0 }, Point{ 0, -1 } };
+
+	static constexpr std::array<int32, Directions> Opposite{ 2, 3, 0, 1 };
+
+	static int32 CellCount(const Extent& size) {
+		return size.x * size.y;
+	}
+
+	static int32 Index(const Extent& size, const Position& p) {
+		return p.x + p.y * size.x;
+	}
+
+	static Position Coordinates(const Extent& size, int32 i) {
+		return { i % size.x, i / size.x };
+	}
+
+	// 非周期のときはN×Nの窓が盤面に収まるセルだけがノードになる
+	static bool IsNode(const Extent& size, int32 N, bool periodic, const Position& p) {
+		return periodic || (p.x + N <= size.x && p.y + N <= size.y);
+	}
+
+	static int32 Neighbor(const Extent& size, int32 N, bool periodic, const Position& p, int32 d) {
+		auto q = p + Offsets[d];
+
+		if (!periodic && (q.x < 0 || q.y < 0 || q.x + N > size.x || q.y + N > size.y))
+			return -1;
+
+		if (q.x < 0)
+			q.x += size.x;
+		else if (q.x >= size.x)
+			q.x -= size.x;
+
+		if (q.y < 0)
+			q.y += size.y;
+		else if (q.y >= size.y)
+			q.y -= size.y;
+
+		return q.x + q.y * size.x;
+	}
+
+	static Region CellRegion(const Position& p) {
+		return Rect{ p, 1 };
+	}
+
+	// groundは最下段に最後のタイルを敷き、それより上には置かない
+	static Region GroundRegion(const Extent& size) {
+		return Rect{ 0, size.y - 1, size.x, 1 };
+	}
+
+	static Region AboveGroundRegion(const Extent& size) {
+		return Rect{ 0, 0, size.x, size.y - 1 };
+	}
+
+	template <class Fn>
+	static void EachCell(const Extent& size, const Region& region, Fn f) {
+		const int32 xmin = Max(region.x, 0), xmax = Min(region.x + region.w, size.x);
+		const int32 ymin = Max(region.y, 0), ymax = Min(region.y + region.h, size.y);
+
+		for (int32 y = ymin; y < ymax; y++) {
+			for (int32 x = xmin; x < xmax; x++) {
+				f(x + y * size.x);
+			}
+		}
+	}
+};
+
+struct Topology3D {
+
+	struct Position {
+		int32 x = 0;
+		int32 y = 0;
+		int32 z = 0;
+
+		constexpr Position operator+(const Position& other) const {
+			return { x + other.x, y + other.y, z + other.z };
+		}
+
+		constexpr bool operator==(const Position& other) const = default;
+	};
+
+	using Extent = Position;
+
+	struct Region {
+		Position pos;
+		Extent size;
+	};
+
+	static constexpr int32 Directions = 6;
+
+	// 0:-x 1:+y(上) 2:+x 3:-y(下) 4:+z 5:-z
+	static constexpr std::array<Position, Directions> Offsets{ {
+		{ -1, 0, 0 }, { 0, 1, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }
+	} };
+
+	static constexpr std::array<int32, Directions> Opposite{ 2, 3, 0, 1, 5, 4 };
+
+	static int32 CellCount(const Extent& size) {
+		return size.x * size.y * size.z;
+	}
+
+	static int32 Index(const Extent& size, const Position& p) {
+		return p.x + (p.y + p.z * size.y) * size.x;
+	}
+
+	static Position Coordinates(const Extent& size, int32 i) {
+		return { i % size.x, (i / size.x) % size.y, i / (size.x * size.y) };
+	}
+
+	static bool IsNode(const Extent& size, int32 N, bool periodic, const Position& p) {
+		return periodic || (p.x + N <= size.x && p.y + N <= size.y && p.z + N <= size.z);
+	}
+
+	static int32 Neighbor(const Extent& size, int32 N, bool periodic, const Position& p, int32 d) {
+		auto q = p + Offsets[d];
+
+		if (!periodic && (q.x < 0 || q.y < 0 || q.z < 0 || q.x + N > size.x || q.y + N > size.y || q.z + N > size.z))
+			return -1;
+
+		q.x = (q.x + size.x) % size.x;
+		q.y = (q.y + size.y) % size.y;
+		q.z = (q.z + size.z) % size.z;
+
+		return Index(size, q);
+	}
+
+	static Region CellRegion(const Position& p) {
+		return { p, { 1, 1, 1 } };
+	}
+
+	// 3Dではy=0の層を地面とする
+	static Region GroundRegion(const Extent& size) {
+		return { { 0, 0, 0 }, { size.x, 1, size.z } };
+	}
+
+	static Region AboveGroundRegion(const Extent& size) {
+		return { { 0, 1, 0 }, { size.x, size.y - 1, size.z } };
+	}
+
+	template <class Fn>
+	static void EachCell(const Extent& size, const Region& region, Fn f) {
+		const int32 xmin = Max(region.pos.x, 0), xmax = Min(region.pos.x + region.size.x, size.x);
+		const int32 ymin = Max(region.pos.y, 0), ymax = Min(region.pos.y + region.size.y, size.y);
+		const int32 zmin = Max(region.pos.z, 0), zmax = Min(region.pos.z + region.size.z, size.z);
+
+		for (int32 z = zmin; z < zmax; z++) {
+			for (int32 y = ymin; y < ymax; y++) {
+				for (int32 x = xmin; x < xmax; x++) {
+					f(Index(size, { x, y, z }));
+				}
+			}
+		}
+	}
+};
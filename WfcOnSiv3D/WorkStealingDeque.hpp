@@ -0,0 +1,114 @@
+﻿# pragma once
+# include <atomic>
+# include <bit>
+# include <memory>
+
+// Chase-Lev の作業窃取キュー。push/pop は所有スレッドだけが、steal は他のスレッドが呼ぶ
+// 容量が足りなくなると倍の領域へ移す。古い領域は他スレッドが読んでいる可能性があるので reset() まで解放しない
+class WorkStealingDeque
+{
+public:
+
+	explicit WorkStealingDeque(int64 capacity = 1024) {
+		m_buffers.push_back(std::make_unique<Buffer>(capacity));
+		m_buffer.store(m_buffers.back().get(), std::memory_order_relaxed);
+	}
+
+	void push(uint64 item) {
+		const int64 b = m_bottom.load(std::memory_order_relaxed);
+		const int64 t = m_top.load(std::memory_order_acquire);
+		Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+
+		if (b - t > buffer->mask) {
+			buffer = grow(buffer, t, b);
+		}
+
+		buffer->put(b, item);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	bool pop(uint64& item) {
+		const int64 b = m_bottom.load(std::memory_order_relaxed) - 1;
+		Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+		m_bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64 t = m_top.load(std::memory_order_relaxed);
+
+		if (t > b) {
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+
+		item = buffer->get(b);
+		if (t == b) {
+			// 最後の1つは steal と取り合いになる
+			const bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+		return true;
+	}
+
+	bool steal(uint64& item) {
+		int64 t = m_top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const int64 b = m_bottom.load(std::memory_order_acquire);
+
+		if (t >= b) {
+			return false;
+		}
+
+		Buffer* buffer = m_buffer.load(std::memory_order_acquire);
+		item = buffer->get(t);
+		return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+	}
+
+	// どのスレッドも触っていないときだけ呼べる。中身を捨て、古い領域を解放する
+	void reset() {
+		if (m_buffers.size() > 1) {
+			std::swap(m_buffers.front(), m_buffers.back());
+			m_buffers.resize(1);
+		}
+		m_buffer.store(m_buffers.front().get(), std::memory_order_relaxed);
+		m_top.store(0, std::memory_order_relaxed);
+		m_bottom.store(0, std::memory_order_relaxed);
+	}
+
+private:
+
+	struct Buffer {
+		int64 mask;
+		std::unique_ptr<std::atomic<uint64>[]> items;
+
+		explicit Buffer(int64 capacity)
+			: mask(std::bit_ceil(static_cast<uint64>(Max<int64>(capacity, 2))) - 1), items(new std::atomic<uint64>[mask + 1]) {}
+
+		uint64 get(int64 i) const {
+			return items[i & mask].load(std::memory_order_relaxed);
+		}
+
+		void put(int64 i, uint64 item) {
+			items[i & mask].store(item, std::memory_order_relaxed);
+		}
+	};
+
+	Buffer* grow(Buffer* old, int64 t, int64 b) {
+		m_buffers.push_back(std::make_unique<Buffer>((old->mask + 1) * 2));
+		Buffer* buffer = m_buffers.back().get();
+
+		for (int64 i = t; i < b; ++i) {
+			buffer->put(i, old->get(i));
+		}
+
+		m_buffer.store(buffer, std::memory_order_release);
+		return buffer;
+	}
+
+	alignas(64) std::atomic<int64> m_top{ 0 };
+	alignas(64) std::atomic<int64> m_bottom{ 0 };
+	std::atomic<Buffer*> m_buffer{ nullptr };
+
+	// 所有スレッドだけが触る
+	Array<std::unique_ptr<Buffer>> m_buffers;
+};
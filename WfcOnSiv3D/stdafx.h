@@ -1,3 +1,9 @@
 ﻿# pragma once
 //# define NO_S3D_USING
+
+// WFC_STANDALONE を定義すると Siv3D なしでソルバー本体だけをビルドできる(CMakeLists.txt の wfc_core)
+# ifdef WFC_STANDALONE
+# include "WfcStandalone.hpp"
+# else
 # include <Siv3D.hpp>
+# endif
@@ -0,0 +1,175 @@
+﻿# include "stdafx.h"
+# include "WfcModel.hpp"
+# include <chrono>
+
+// 並列伝播がどの大きさから逐次より速くなるかを測る。画像を使わずに済むよう規則はここで作る
+//
+//	wfc_benchmark [スレッド数]
+//
+// 盤面全体をタイルの半分に絞る制約を付けて clear() し、最初の伝播を逐次と並列(閾値1で常に並列)で比べる
+// 初期のスタックの大きさが閾値と同じ単位なので、並列のほうが速くなった最小の大きさを
+// cmake -DWFC_PARALLEL_THRESHOLD=... に渡すと DefaultParallelThreshold になる
+// 先に Entropy と Frontier で逐次と並列の run() の結果が一致するかを確かめ、違えば終了コード1を返す
+
+namespace
+{
+	// タイルを環状に並べ、番号の差が width 以内のものだけを隣に置ける。全セル同じタイルで必ず解ける
+	std::shared_ptr<const WfcRuleSet> MakeRingRules(int32 T, int32 width) {
+		auto rules = std::make_shared<WfcRuleSet>();
+		rules->weights.resize(T);
+		for (int32 t = 0; t < T; t++) {
+			rules->weights[t] = 1.0 + t % 3;
+		}
+
+		rules->propagator.assign(Topology2D::Directions, Array<Array<int32>>(T));
+		for (int32 d = 0; d < Topology2D::Directions; d++) {
+			for (int32 t1 = 0; t1 < T; t1++) {
+				for (int32 t2 = 0; t2 < T; t2++) {
+					const int32 distance = Min((t1 - t2 + T) % T, (t2 - t1 + T) % T);
+					if (distance <= width) {
+						rules->propagator[d][t1] << t2;
+					}
+				}
+			}
+		}
+
+		rules->finalize();
+		return rules;
+	}
+
+	class BenchmarkModel : public WfcModel
+	{
+	public:
+
+		BenchmarkModel(std::shared_ptr<const WfcRuleSet> rules, const Size& gridSize, Heuristic heuristic = Heuristic::Entropy)
+			: WfcModel(std::move(rules), gridSize, 1, true, heuristic) {}
+	};
+
+	// 制約付きの clear() の中央値(ミリ秒)。制約を付け直して毎回伝播させる
+	double MeasureClear(BenchmarkModel& model, const Size& gridSize, const Array<bool>& allowed, int32 repeats) {
+		Array<double> times;
+
+		for (int32 r = 0; r < repeats; r++) {
+			model.clearConstraints();
+			model.constrain(Rect{ 0, 0, gridSize.x, gridSize.y }, allowed);
+
+			const auto start = std::chrono::steady_clock::now();
+			model.clear();
+			times << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		std::sort(times.begin(), times.end());
+		return times[times.size() / 2];
+	}
+
+	// 同じシードで逐次と並列(閾値1で常に並列)の run() の結果が一致した回数
+	int32 CountSameAsSerial(const std::shared_ptr<const WfcRuleSet>& rules, WfcModel::Heuristic heuristic, int32 threads, int32 runs) {
+		const Size gridSize{ 32, 32 };
+		int32 same = 0;
+
+		for (int32 seed = 0; seed < runs; seed++) {
+			BenchmarkModel serial{ rules, gridSize, heuristic };
+			BenchmarkModel parallel{ rules, gridSize, heuristic };
+			parallel.setPropagationThreads(threads, 1);
+
+			const bool serialResult = serial.run(seed, -1);
+			const bool parallelResult = parallel.run(seed, -1);
+
+			if (serialResult == parallelResult && serial.observed() == parallel.observed()) {
+				same++;
+			}
+		}
+
+		return same;
+	}
+}
+
+int main(int argc, char** argv) {
+	const int32 threads = argc > 1 ? std::atoi(argv[1]) : Max(static_cast<int32>(Threading::GetConcurrency()), 2);
+
+	std::cout << "hardware threads " << Threading::GetConcurrency() << ", propagation threads " << threads << std::endl;
+
+	struct Case {
+		const char* name;
+		int32 T;
+		int32 width;
+	};
+
+	// どちらの核でも元が取れる大きさ。どちらかで取れなければ -1
+	int64 recommended = 0;
+	bool mismatched = false;
+
+	for (const Case& c : { Case{ "single-word", 48, 6 }, Case{ "generic", 160, 12 } }) {
+		const auto rules = MakeRingRules(c.T, c.width);
+
+		Array<bool> allowed(c.T, false);
+		for (int32 t = 0; t < c.T / 2; t++) {
+			allowed[t] = true;
+		}
+
+		std::cout << std::endl << c.name << " (T = " << c.T << ")" << std::endl;
+
+		// 並列にしても同じシードなら同じ結果になること
+		constexpr int32 Runs = 10;
+		for (const auto [heuristic, name] : { std::pair{ WfcModel::Heuristic::Entropy, "Entropy" }, std::pair{ WfcModel::Heuristic::Frontier, "Frontier" } }) {
+			const int32 same = CountSameAsSerial(rules, heuristic, threads, Runs);
+			std::cout << name << ": " << same << "/" << Runs << " runs same as serial" << std::endl;
+
+			if (same != Runs) {
+				std::cout << "ERROR: parallel propagation changed the result with " << name << std::endl;
+				mismatched = true;
+			}
+		}
+
+		std::cout << "grid\tstack\tserial ms\tparallel ms\tspeedup" << std::endl;
+
+		int64 crossover = -1;
+
+		for (const int32 n : { 8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384 }) {
+			const Size gridSize{ n, n };
+			const int32 repeats = n <= 64 ? 21 : 7;
+
+			// 逐次では1セル1エントリ、汎用ではタイル1つの除去につき1エントリ積まれる
+			const int64 stack = static_cast<int64>(n) * n * (rules->isSingleWord() ? 1 : c.T - c.T / 2);
+
+			BenchmarkModel serial{ rules, gridSize };
+			serial.init();
+			const double serialTime = MeasureClear(serial, gridSize, allowed, repeats);
+
+			BenchmarkModel parallel{ rules, gridSize };
+			parallel.init();
+			parallel.setPropagationThreads(threads, 1);
+			const double parallelTime = MeasureClear(parallel, gridSize, allowed, repeats);
+
+			if (crossover < 0 && parallelTime < serialTime) {
+				crossover = stack;
+			}
+
+			std::cout << n << "x" << n << "\t" << stack << "\t" << serialTime << "\t" << parallelTime << "\t" << serialTime / parallelTime << std::endl;
+
+			// 1回が長くなりすぎたら打ち切る
+			if (serialTime > 200.0) {
+				break;
+			}
+		}
+
+		if (crossover < 0) {
+			std::cout << "parallel propagation did not pay off at any size" << std::endl;
+		}
+		else {
+			std::cout << "parallel propagation pays off from a stack of " << crossover << " entries" << std::endl;
+		}
+
+		recommended = (crossover < 0 || recommended < 0) ? -1 : Max(recommended, crossover);
+	}
+
+	std::cout << std::endl;
+	if (recommended < 0) {
+		std::cout << "keep parallel propagation off on this machine (setPropagationThreads(1))" << std::endl;
+	}
+	else {
+		std::cout << "recommended: -DWFC_PARALLEL_THRESHOLD=" << recommended << std::endl;
+	}
+
+	return mismatched ? 1 : 0;
+}